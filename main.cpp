@@ -26,13 +26,29 @@
 #include "stable-diffusion.h"
 
 #include <algorithm> // For std::max
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint> // For uint32_t
+#include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <stack>
 
 #ifdef SLOP_WINDOWS_BUILD
@@ -40,6 +56,10 @@
 #include <windows.h>
 #endif
 
+#ifdef SLOP_LINUX_BUILD
+#include <unistd.h>
+#endif
+
 using json = nlohmann::json;
 
 namespace fs = std::filesystem;
@@ -100,16 +120,763 @@ template <typename T> T min(T a, T b) { return std::min(a, b); }
 
 const std::string settings_file = config_dir + "/settings.json";
 
+// Kernels that need more than SSE2 are compiled for their instruction set
+// with a target attribute and picked at run time, so a default build still
+// uses them on CPUs that have them.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SLOP_X86_DISPATCH
+#define SLOP_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define SLOP_X86_DISPATCH
+#define SLOP_TARGET(isa)
+#endif
+
+#ifdef SLOP_X86_DISPATCH
+struct CpuFeatures {
+  bool ssse3 = false;
+  bool avx2 = false;
+};
+
+CpuFeatures detectCpuFeatures() {
+  CpuFeatures features;
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  features.ssse3 = __builtin_cpu_supports("ssse3");
+  features.avx2 = __builtin_cpu_supports("avx2");
+#else
+  int info[4];
+  __cpuid(info, 1);
+  features.ssse3 = (info[2] & (1 << 9)) != 0;
+  // AVX2 also needs the OS to save the upper halves of the ymm registers
+  bool ymmSaved = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+  __cpuidex(info, 7, 0);
+  features.avx2 = ymmSaved && (info[1] & (1 << 5)) != 0;
+#endif
+  return features;
+}
+
+const CpuFeatures cpuFeatures = detectCpuFeatures();
+#endif
+
+// Layers are stored as a grid of TILE_SIZE x TILE_SIZE tiles so that edits,
+// uploads and compositing only touch the tiles an operation changed. Tiles on
+// the right and bottom edges are padded past the layer size. Tiles whose
+// pixels all share one colour (untouched, erased or filled regions) are kept
+// as that colour alone and only get pixel storage once they are drawn on.
+// Pixel blocks are shared with the undo history and copied on first write.
+const int TILE_SIZE = 256;
+
+// What the alpha of a tile's visible pixels looks like, so that compositing
+// can skip transparent tiles, copy opaque ones and ignore what they hide.
+// Tiles are classified when they are compacted; edited tiles are Unknown until
+// then and are composited like Mixed ones.
+enum class TileCoverage { Unknown, Transparent, Opaque, Mixed };
+
+struct Tile {
+  // TILE_SIZE * TILE_SIZE RGBA pixels, row-major. Null for uniform tiles.
+  std::shared_ptr<std::vector<unsigned char>> pixels;
+  // Colour of every pixel while the tile is uniform.
+  unsigned char color[4] = {0, 0, 0, 0};
+  TileCoverage coverage = TileCoverage::Transparent;
+  // The displayed copy of this tile (the layer's own texture or the
+  // viewport) is out of date.
+  bool dirty = true;
+};
+
+// GL textures are owned through TextureHandle and recycled through a pool
+// keyed on size and format, so recreating a same-sized texture (a resized or
+// reloaded layer, a new selection overlay) reuses an existing allocation.
+// A released texture may still be drawn by the frame being built, so it is
+// only reused or deleted once that frame has been rendered.
+struct TextureHandle {
+  GLuint id = 0;
+  int width = 0;
+  int height = 0;
+  GLenum format = GL_RGBA;
+
+  TextureHandle() = default;
+  // A copy starts without a texture, and assigning over a handle releases
+  // the one it held: whatever owns the handle has new contents and builds a
+  // new texture the next time it is displayed.
+  TextureHandle(const TextureHandle &) {}
+  TextureHandle &operator=(const TextureHandle &other);
+  TextureHandle(TextureHandle &&other) noexcept;
+  TextureHandle &operator=(TextureHandle &&other) noexcept;
+  ~TextureHandle();
+};
+
+struct PooledTexture {
+  GLuint id;
+  int width;
+  int height;
+  GLenum format;
+};
+
+struct TexturePool {
+  // Released this frame
+  std::vector<PooledTexture> retired;
+  // Free for reuse, oldest first
+  std::vector<PooledTexture> idle;
+  size_t idleBytes = 0;
+  size_t budget = 256 * 1024 * 1024;
+};
+
+TexturePool texturePool;
+
+size_t pooledTextureBytes(const PooledTexture &texture) {
+  return (size_t)texture.width * texture.height * 4;
+}
+
+void releaseTexture(TextureHandle *handle) {
+  if (handle->id != 0) {
+    texturePool.retired.push_back(
+        {handle->id, handle->width, handle->height, handle->format});
+    handle->id = 0;
+  }
+}
+
+TextureHandle &TextureHandle::operator=(const TextureHandle &other) {
+  if (this != &other) {
+    releaseTexture(this);
+  }
+  return *this;
+}
+
+TextureHandle::TextureHandle(TextureHandle &&other) noexcept
+    : id(other.id), width(other.width), height(other.height),
+      format(other.format) {
+  other.id = 0;
+}
+
+TextureHandle &TextureHandle::operator=(TextureHandle &&other) noexcept {
+  if (this != &other) {
+    releaseTexture(this);
+    id = other.id;
+    width = other.width;
+    height = other.height;
+    format = other.format;
+    other.id = 0;
+  }
+  return *this;
+}
+
+TextureHandle::~TextureHandle() { releaseTexture(this); }
+
+// Give the handle a width x height texture with undefined contents, reusing
+// an idle one of the same size and format when there is one. The texture is
+// left bound.
+void acquireTexture(TextureHandle *handle, int width, int height,
+                    GLenum format = GL_RGBA) {
+  releaseTexture(handle);
+  handle->width = width;
+  handle->height = height;
+  handle->format = format;
+
+  for (int i = (int)texturePool.idle.size() - 1; i >= 0; i--) {
+    const PooledTexture &texture = texturePool.idle[i];
+    if (texture.width == width && texture.height == height &&
+        texture.format == format) {
+      handle->id = texture.id;
+      texturePool.idleBytes -= pooledTextureBytes(texture);
+      texturePool.idle.erase(texturePool.idle.begin() + i);
+      glBindTexture(GL_TEXTURE_2D, handle->id);
+      return;
+    }
+  }
+
+  glGenTextures(1, &(handle->id));
+  glBindTexture(GL_TEXTURE_2D, handle->id);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
+               GL_UNSIGNED_BYTE, NULL);
+}
+
+// Called once the frame has been rendered: textures released during it
+// become reusable, and the oldest idle ones are deleted once the pool holds
+// more than its budget.
+void recycleRetiredTextures() {
+  for (const PooledTexture &texture : texturePool.retired) {
+    texturePool.idle.push_back(texture);
+    texturePool.idleBytes += pooledTextureBytes(texture);
+  }
+  texturePool.retired.clear();
+
+  size_t evicted = 0;
+  while (evicted < texturePool.idle.size() &&
+         texturePool.idleBytes > texturePool.budget) {
+    const PooledTexture &texture = texturePool.idle[evicted++];
+    glDeleteTextures(1, &texture.id);
+    texturePool.idleBytes -= pooledTextureBytes(texture);
+  }
+  texturePool.idle.erase(texturePool.idle.begin(),
+                         texturePool.idle.begin() + evicted);
+}
+
+void clearTexturePool() {
+  size_t budget = texturePool.budget;
+  texturePool.budget = 0;
+  recycleRetiredTextures();
+  texturePool.budget = budget;
+}
+
 struct Layer {
   int height;
   int width;
   bool enabled;
-  GLuint layerData;
+  // Identifies the layer across reorders in the undo history.
+  int id = 0;
+  // Display copy of the tiles, created and updated by syncLayerTexture.
+  TextureHandle layerData;
+  int tilesX = 0;
+  int tilesY = 0;
+  // Row-major, tilesX * tilesY; this is the authoritative copy of the layer.
+  std::vector<Tile> tiles;
 
 } typedef Layer;
 
+// Layer ids are never reused, so history entries can't mix up two layers.
+int nextLayerId = 1;
+
+int newLayerId() { return nextLayerId++; }
+
+int findLayerIndex(const std::vector<Layer> &layers, int id) {
+  for (int i = 0; i < layers.size(); i++) {
+    if (layers[i].id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Texture uploads are staged through a ring of pixel buffer objects, so
+// glTexSubImage2D reads from driver-owned memory and returns without waiting
+// for the copy. Each slot is fenced once its uploads are issued and is only
+// written again after the GPU has finished reading it. Contexts without
+// buffer mapping and sync objects upload straight from client memory.
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW
+#define GL_STREAM_DRAW 0x88E0
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_ALREADY_SIGNALED 0x911A
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_CONDITION_SATISFIED 0x911C
+#define GL_WAIT_FAILED 0x911D
+#endif
+
+const int UPLOAD_RING_SLOTS = 4;
+const size_t UPLOAD_SLOT_SIZE = 16 * TILE_SIZE * TILE_SIZE * 4;
+
+struct PendingUpload {
+  GLuint texture;
+  int x, y, width, height;
+  size_t offset;
+};
+
+struct UploadRing {
+  bool available = false;
+
+  void(APIENTRY *genBuffers)(GLsizei, GLuint *) = nullptr;
+  void(APIENTRY *deleteBuffers)(GLsizei, const GLuint *) = nullptr;
+  void(APIENTRY *bindBuffer)(GLenum, GLuint) = nullptr;
+  void(APIENTRY *bufferData)(GLenum, ptrdiff_t, const void *, GLenum) = nullptr;
+  void *(APIENTRY *mapBufferRange)(GLenum, ptrdiff_t, ptrdiff_t,
+                                   GLbitfield) = nullptr;
+  GLboolean(APIENTRY *unmapBuffer)(GLenum) = nullptr;
+  void *(APIENTRY *fenceSync)(GLenum, GLbitfield) = nullptr;
+  GLenum(APIENTRY *clientWaitSync)(void *, GLbitfield, uint64_t) = nullptr;
+  void(APIENTRY *deleteSync)(void *) = nullptr;
+
+  GLuint buffers[UPLOAD_RING_SLOTS] = {};
+  void *fences[UPLOAD_RING_SLOTS] = {};
+  int slot = 0;
+  unsigned char *mapped = nullptr;
+  size_t used = 0;
+  std::vector<PendingUpload> pending;
+};
+
+UploadRing uploadRing;
+
+// Needs the GL context to be current. Leaves the ring unavailable when the
+// context is older than GL 3.0 or has no sync objects.
+void initUploadRing(UploadRing *ring) {
+#if !defined(IMGUI_IMPL_OPENGL_ES2) && !defined(__EMSCRIPTEN__)
+  GLFWwindow *context = glfwGetCurrentContext();
+  int major = glfwGetWindowAttrib(context, GLFW_CONTEXT_VERSION_MAJOR);
+  int minor = glfwGetWindowAttrib(context, GLFW_CONTEXT_VERSION_MINOR);
+  bool hasSync = major > 3 || (major == 3 && minor >= 2) ||
+                 glfwExtensionSupported("GL_ARB_sync");
+  if (major < 3 || !hasSync) {
+    return;
+  }
+
+  ring->genBuffers = (decltype(ring->genBuffers))glfwGetProcAddress(
+      "glGenBuffers");
+  ring->deleteBuffers = (decltype(ring->deleteBuffers))glfwGetProcAddress(
+      "glDeleteBuffers");
+  ring->bindBuffer = (decltype(ring->bindBuffer))glfwGetProcAddress(
+      "glBindBuffer");
+  ring->bufferData = (decltype(ring->bufferData))glfwGetProcAddress(
+      "glBufferData");
+  ring->mapBufferRange = (decltype(ring->mapBufferRange))glfwGetProcAddress(
+      "glMapBufferRange");
+  ring->unmapBuffer = (decltype(ring->unmapBuffer))glfwGetProcAddress(
+      "glUnmapBuffer");
+  ring->fenceSync = (decltype(ring->fenceSync))glfwGetProcAddress(
+      "glFenceSync");
+  ring->clientWaitSync = (decltype(ring->clientWaitSync))glfwGetProcAddress(
+      "glClientWaitSync");
+  ring->deleteSync = (decltype(ring->deleteSync))glfwGetProcAddress(
+      "glDeleteSync");
+  if (!ring->genBuffers || !ring->deleteBuffers || !ring->bindBuffer ||
+      !ring->bufferData || !ring->mapBufferRange || !ring->unmapBuffer ||
+      !ring->fenceSync || !ring->clientWaitSync || !ring->deleteSync) {
+    return;
+  }
+
+  ring->genBuffers(UPLOAD_RING_SLOTS, ring->buffers);
+  for (int i = 0; i < UPLOAD_RING_SLOTS; i++) {
+    ring->bindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[i]);
+    ring->bufferData(GL_PIXEL_UNPACK_BUFFER, UPLOAD_SLOT_SIZE, NULL,
+                     GL_STREAM_DRAW);
+  }
+  ring->bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  ring->available = true;
+#endif
+}
+
+// Maps the current slot for writing, first waiting for the GPU to finish
+// the uploads last issued from it.
+bool mapUploadSlot(UploadRing *ring) {
+  int slot = ring->slot;
+  if (ring->fences[slot]) {
+    // The slot is overwritten unsynchronized, so the GPU must be done with
+    // it. If the wait itself fails, the caller uploads directly instead.
+    GLenum result = ring->clientWaitSync(
+        ring->fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+    while (result == GL_TIMEOUT_EXPIRED) {
+      result = ring->clientWaitSync(ring->fences[slot], 0, 1000000000ull);
+    }
+    if (result == GL_WAIT_FAILED) {
+      return false;
+    }
+    ring->deleteSync(ring->fences[slot]);
+    ring->fences[slot] = nullptr;
+  }
+
+  ring->bindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[slot]);
+  ring->mapped = (unsigned char *)ring->mapBufferRange(
+      GL_PIXEL_UNPACK_BUFFER, 0, UPLOAD_SLOT_SIZE,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT |
+          GL_MAP_UNSYNCHRONIZED_BIT);
+  ring->bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  ring->used = 0;
+  return ring->mapped != nullptr;
+}
+
+// Issues the uploads staged in the current slot and moves to the next one.
+void flushUploads(UploadRing *ring) {
+  if (!ring->mapped) {
+    return;
+  }
+
+  ring->bindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->buffers[ring->slot]);
+  ring->unmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  for (const PendingUpload &upload : ring->pending) {
+    glBindTexture(GL_TEXTURE_2D, upload.texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, upload.x, upload.y, upload.width,
+                    upload.height, GL_RGBA, GL_UNSIGNED_BYTE,
+                    (const void *)(uintptr_t)upload.offset);
+  }
+  ring->fences[ring->slot] =
+      ring->fenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  ring->bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  ring->pending.clear();
+  ring->mapped = nullptr;
+  ring->slot = (ring->slot + 1) % UPLOAD_RING_SLOTS;
+}
+
+// Upload a width x height RGBA rectangle whose rows are rowLength pixels
+// apart. The texture is written by the time the staged uploads are flushed.
+void uploadTextureRect(UploadRing *ring, GLuint texture, int x, int y,
+                       int width, int height, const unsigned char *pixels,
+                       int rowLength) {
+  size_t rowBytes = (size_t)width * 4;
+  size_t size = rowBytes * height;
+
+  if (ring->available && size <= UPLOAD_SLOT_SIZE) {
+    if (ring->mapped && ring->used + size > UPLOAD_SLOT_SIZE) {
+      flushUploads(ring);
+    }
+    if (ring->mapped || mapUploadSlot(ring)) {
+      for (int row = 0; row < height; row++) {
+        std::memcpy(ring->mapped + ring->used + row * rowBytes,
+                    pixels + (size_t)row * rowLength * 4, rowBytes);
+      }
+      ring->pending.push_back({texture, x, y, width, height, ring->used});
+      ring->used += size;
+      return;
+    }
+    ring->available = false;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA,
+                  GL_UNSIGNED_BYTE, pixels);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// Also frees the buffers of a ring that was switched off after a failed
+// map or fence wait.
+void destroyUploadRing(UploadRing *ring) {
+  if (ring->buffers[0] == 0) {
+    return;
+  }
+  if (ring->available) {
+    flushUploads(ring);
+  }
+  for (int i = 0; i < UPLOAD_RING_SLOTS; i++) {
+    if (ring->fences[i]) {
+      ring->deleteSync(ring->fences[i]);
+      ring->fences[i] = nullptr;
+    }
+  }
+  ring->deleteBuffers(UPLOAD_RING_SLOTS, ring->buffers);
+  std::memset(ring->buffers, 0, sizeof(ring->buffers));
+  ring->available = false;
+}
+
+// Drop the layer's texture; it is recreated from the tiles the next time the
+// layer is displayed.
+void releaseLayerTexture(struct Layer *layer) {
+  releaseTexture(&layer->layerData);
+}
+
 void freeLayer(struct Layer *layer) {
-  glDeleteTextures(1, &(layer->layerData));
+  releaseLayerTexture(layer);
+  std::vector<Tile>().swap(layer->tiles);
+}
+
+// Turn the tile into a uniform tile of the given colour, freeing its pixels.
+void fillTile(Tile *tile, int r, int g, int b, int alpha) {
+  tile->pixels.reset();
+  tile->color[0] = r;
+  tile->color[1] = g;
+  tile->color[2] = b;
+  tile->color[3] = alpha;
+  tile->dirty = true;
+
+  if (alpha == 0) {
+    tile->coverage = TileCoverage::Transparent;
+  } else if (alpha == 255) {
+    tile->coverage = TileCoverage::Opaque;
+  } else {
+    tile->coverage = TileCoverage::Mixed;
+  }
+}
+
+// Give the tile pixel storage of its own so that it can be edited. Uniform
+// tiles are expanded and blocks still shared with the history are copied.
+void materializeTile(Tile *tile) {
+  tile->coverage = TileCoverage::Unknown;
+
+  if (tile->pixels) {
+    if (tile->pixels.use_count() > 1) {
+      tile->pixels =
+          std::make_shared<std::vector<unsigned char>>(*tile->pixels);
+    }
+    return;
+  }
+
+  tile->pixels =
+      std::make_shared<std::vector<unsigned char>>(TILE_SIZE * TILE_SIZE * 4);
+  unsigned char *pixels = tile->pixels->data();
+  for (int i = 0; i < TILE_SIZE * TILE_SIZE * 4; i += 4) {
+    std::memcpy(pixels + i, tile->color, 4);
+  }
+}
+
+// Resize the layer's tile grid, discarding its contents. New tiles are
+// uniform transparent black and take no pixel storage.
+void allocateLayerTiles(Layer *layer, int width, int height) {
+  releaseLayerTexture(layer);
+  layer->width = width;
+  layer->height = height;
+  layer->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+  layer->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+  layer->tiles.assign(layer->tilesX * layer->tilesY, Tile());
+}
+
+// Classify tiles edited since they were last looked at, and return those
+// whose visible pixels all ended up the same colour to the uniform
+// representation. Padding past the layer edge is ignored.
+void compactLayerTiles(Layer *layer) {
+  for (int ty = 0; ty < layer->tilesY; ty++) {
+    for (int tx = 0; tx < layer->tilesX; tx++) {
+      Tile &tile = layer->tiles[ty * layer->tilesX + tx];
+      if (!tile.pixels || tile.coverage != TileCoverage::Unknown) {
+        continue;
+      }
+
+      int tileWidth = min(TILE_SIZE, layer->width - tx * TILE_SIZE);
+      int tileHeight = min(TILE_SIZE, layer->height - ty * TILE_SIZE);
+      const unsigned char *first = tile.pixels->data();
+
+      bool uniform = true;
+      bool opaque = true;
+      bool transparent = true;
+      for (int y = 0; y < tileHeight && (uniform || opaque || transparent);
+           y++) {
+        const unsigned char *row = first + y * TILE_SIZE * 4;
+        for (int x = 0; x < tileWidth; x++) {
+          const unsigned char *pixel = row + x * 4;
+          uniform = uniform && std::memcmp(pixel, first, 4) == 0;
+          opaque = opaque && pixel[3] == 255;
+          transparent = transparent && pixel[3] == 0;
+          if (!uniform && !opaque && !transparent) {
+            break;
+          }
+        }
+      }
+
+      if (uniform) {
+        // The texture already holds these pixels, so the tile stays clean
+        bool dirty = tile.dirty;
+        fillTile(&tile, first[0], first[1], first[2], first[3]);
+        tile.dirty = dirty;
+      } else if (opaque) {
+        tile.coverage = TileCoverage::Opaque;
+      } else if (transparent) {
+        tile.coverage = TileCoverage::Transparent;
+      } else {
+        tile.coverage = TileCoverage::Mixed;
+      }
+    }
+  }
+}
+
+Tile &layerTileAt(Layer *layer, int x, int y) {
+  return layer->tiles[(y / TILE_SIZE) * layer->tilesX + x / TILE_SIZE];
+}
+
+const Tile &layerTileAt(const Layer &layer, int x, int y) {
+  return layer.tiles[(y / TILE_SIZE) * layer.tilesX + x / TILE_SIZE];
+}
+
+// Address of pixel (x, y), which must lie inside the layer. The tile is
+// given pixel storage first if it was uniform. Callers that write through it
+// are responsible for marking the tile dirty.
+unsigned char *layerPixel(Layer *layer, int x, int y) {
+  Tile &tile = layerTileAt(layer, x, y);
+  materializeTile(&tile);
+  return tile.pixels->data() +
+         ((y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * 4;
+}
+
+// Read-only address of pixel (x, y). For uniform tiles this is the tile
+// colour, so only this one pixel may be read through it.
+const unsigned char *layerPixel(const Layer &layer, int x, int y) {
+  const Tile &tile = layerTileAt(layer, x, y);
+  if (!tile.pixels) {
+    return tile.color;
+  }
+  return tile.pixels->data() +
+         ((y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE) * 4;
+}
+
+// Mark the tiles overlapping [x1, x2) x [y1, y2) as changed.
+void markLayerDirty(struct Layer *layer, int x1, int y1, int x2, int y2) {
+  x1 = max(x1, 0);
+  y1 = max(y1, 0);
+  x2 = min(x2, layer->width);
+  y2 = min(y2, layer->height);
+  if (x1 >= x2 || y1 >= y2) {
+    return;
+  }
+
+  for (int ty = y1 / TILE_SIZE; ty <= (y2 - 1) / TILE_SIZE; ty++) {
+    for (int tx = x1 / TILE_SIZE; tx <= (x2 - 1) / TILE_SIZE; tx++) {
+      layer->tiles[ty * layer->tilesX + tx].dirty = true;
+    }
+  }
+}
+
+// Copy count pixels of row y starting at x out of the layer.
+void readLayerRow(const Layer &layer, int x, int y, int count,
+                  unsigned char *out) {
+  while (count > 0) {
+    int run = min(count, TILE_SIZE - x % TILE_SIZE);
+    const Tile &tile = layerTileAt(layer, x, y);
+    if (!tile.pixels) {
+      for (int i = 0; i < run; i++) {
+        std::memcpy(out + i * 4, tile.color, 4);
+      }
+    } else {
+      std::memcpy(out, layerPixel(layer, x, y), run * 4);
+    }
+    out += run * 4;
+    x += run;
+    count -= run;
+  }
+}
+
+// Copy count pixels into row y of the layer starting at x.
+void writeLayerRow(Layer *layer, int x, int y, int count,
+                   const unsigned char *in) {
+  while (count > 0) {
+    int run = min(count, TILE_SIZE - x % TILE_SIZE);
+    Tile &tile = layerTileAt(layer, x, y);
+    std::memcpy(layerPixel(layer, x, y), in, run * 4);
+    tile.dirty = true;
+    in += run * 4;
+    x += run;
+    count -= run;
+  }
+}
+
+// Replace the layer's contents with a contiguous width x height RGBA image.
+void layerFromBuffer(Layer *layer, const unsigned char *data, int width,
+                     int height) {
+  allocateLayerTiles(layer, width, height);
+  for (int y = 0; y < height; y++) {
+    writeLayerRow(layer, 0, y, width, data + y * width * 4);
+  }
+  compactLayerTiles(layer);
+}
+
+// Expand count RGB pixels to opaque RGBA.
+void rgbToRgbaScalar(unsigned char *dst, const unsigned char *src,
+                     int count) {
+  for (int i = 0; i < count; i++) {
+    dst[i * 4] = src[i * 3];
+    dst[i * 4 + 1] = src[i * 3 + 1];
+    dst[i * 4 + 2] = src[i * 3 + 2];
+    dst[i * 4 + 3] = 255;
+  }
+}
+
+#ifdef SLOP_X86_DISPATCH
+SLOP_TARGET("ssse3")
+void rgbToRgbaSSSE3(unsigned char *dst, const unsigned char *src, int count) {
+  const __m128i shuffle =
+      _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  // Each load reads 16 bytes for the 12 of four pixels; stop while it still
+  // stays inside the source.
+  int i = 0;
+  for (; i + 6 <= count; i += 4) {
+    __m128i rgb = _mm_loadu_si128((const __m128i *)(src + i * 3));
+    _mm_storeu_si128((__m128i *)(dst + i * 4),
+                     _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+  }
+  rgbToRgbaScalar(dst + i * 4, src + i * 3, count - i);
+}
+#endif
+
+void rgbToRgba(unsigned char *dst, const unsigned char *src, int count) {
+#ifdef SLOP_X86_DISPATCH
+  if (cpuFeatures.ssse3) {
+    rgbToRgbaSSSE3(dst, src, count);
+    return;
+  }
+#endif
+  rgbToRgbaScalar(dst, src, count);
+}
+
+// Replace the layer's contents with a contiguous width x height RGB image,
+// converting it straight into the tiles. The result is opaque throughout.
+void layerFromRgb(Layer *layer, const unsigned char *rgb, int width,
+                  int height) {
+  allocateLayerTiles(layer, width, height);
+  for (int ty = 0; ty < layer->tilesY; ty++) {
+    for (int tx = 0; tx < layer->tilesX; tx++) {
+      Tile &tile = layer->tiles[ty * layer->tilesX + tx];
+      materializeTile(&tile);
+
+      int x = tx * TILE_SIZE;
+      int tileWidth = min(TILE_SIZE, width - x);
+      int tileHeight = min(TILE_SIZE, height - ty * TILE_SIZE);
+      for (int row = 0; row < tileHeight; row++) {
+        int y = ty * TILE_SIZE + row;
+        rgbToRgba(tile.pixels->data() + row * TILE_SIZE * 4,
+                  rgb + ((size_t)y * width + x) * 3, tileWidth);
+      }
+      tile.coverage = TileCoverage::Opaque;
+    }
+  }
+}
+
+// Give dst the size and tiles of src, leaving src empty. The layer keeps its
+// id and visibility.
+void replaceLayerTiles(Layer *dst, Layer *src) {
+  releaseLayerTexture(dst);
+  dst->width = src->width;
+  dst->height = src->height;
+  dst->tilesX = src->tilesX;
+  dst->tilesY = src->tilesY;
+  dst->tiles.swap(src->tiles);
+  freeLayer(src);
+}
+
+// Gather the layer into a contiguous RGBA image.
+std::vector<unsigned char> layerToBuffer(const Layer &layer) {
+  std::vector<unsigned char> data(layer.width * layer.height * 4);
+  for (int y = 0; y < layer.height; y++) {
+    readLayerRow(layer, 0, y, layer.width, data.data() + y * layer.width * 4);
+  }
+  return data;
+}
+
+// Bring the layer's texture up to date with its tiles, creating it on first
+// use. Only dirty tiles are uploaded.
+void syncLayerTexture(struct Layer *layer) {
+  // Uniform tiles are expanded here before upload
+  static std::vector<unsigned char> uniformTile(TILE_SIZE * TILE_SIZE * 4);
+
+  bool created = false;
+  if (layer->layerData.id == 0) {
+    acquireTexture(&layer->layerData, layer->width, layer->height);
+    created = true;
+  }
+
+  for (int ty = 0; ty < layer->tilesY; ty++) {
+    for (int tx = 0; tx < layer->tilesX; tx++) {
+      Tile &tile = layer->tiles[ty * layer->tilesX + tx];
+      if (!tile.dirty && !created) {
+        continue;
+      }
+
+      const unsigned char *pixels = tile.pixels ? tile.pixels->data() : NULL;
+      if (!tile.pixels) {
+        for (int i = 0; i < TILE_SIZE * TILE_SIZE * 4; i += 4) {
+          std::memcpy(&uniformTile[i], tile.color, 4);
+        }
+        pixels = uniformTile.data();
+      }
+
+      int x = tx * TILE_SIZE;
+      int y = ty * TILE_SIZE;
+      uploadTextureRect(&uploadRing, layer->layerData.id, x, y,
+                        min(TILE_SIZE, layer->width - x),
+                        min(TILE_SIZE, layer->height - y), pixels, TILE_SIZE);
+      tile.dirty = false;
+    }
+  }
+  flushUploads(&uploadRing);
 }
 
 struct FlattenedLayerData {
@@ -118,14 +885,29 @@ struct FlattenedLayerData {
   int height;
 };
 
+// A brush stroke in progress. Each pixel is drawn as the stroke colour over
+// the layer as it was when the stroke began, at the highest coverage any dab
+// has given it so far, so overlapping dabs don't build up.
+struct Stroke {
+  std::map<int, Tile> base;
+  std::map<int, std::vector<unsigned char>> coverage;
+  // Erasing strokes remove alpha by the coverage instead of painting; the
+  // brush alpha sets how much.
+  bool erase = false;
+};
+
 struct BrushState {
   int radius;
+  float hardness = 1.0f;
   float RGBA[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+  bool erase = false;
 };
 
 struct GenerationState {
   int height = 512;
   int width = 512;
+  // Images sampled per run; more than one are offered as candidates
+  int batchCount = 1;
 };
 
 struct SelectionState {
@@ -149,7 +931,7 @@ struct SelectionState {
   bool bottomLeftScaleMode = false;
   bool topScaleMode = false;
 
-  GLuint selection;
+  Layer selection;
 };
 
 struct LayerResizeState {
@@ -160,10 +942,10 @@ struct LayerResizeState {
 struct EnvironmentState {
   bool stable_diffusion_path_set;
   std::string stable_diffusion_path;
+  bool inpaint_with_webui = false;
 };
 
 struct ProgramState {
-  bool drawMode = false;
   bool inpaintMode = false;
   bool dragMode = false;
   bool selectionMode = false;
@@ -172,6 +954,9 @@ struct ProgramState {
   bool generationSettingsOpen = false;
   bool resizeLayerDialogOpen = false;
   bool warningDialogOpen = false;
+  bool historySettingsOpen = false;
+
+  int historyBudgetMB = 256;
 
   std::string warningMessage;
 
@@ -251,20 +1036,25 @@ enum class ActionType {
   Generate,
   Inpaint,
   Undo,
+  Redo,
   BrushSettings,
   GenerationSettings,
   BoxSelect,
   ResizeLayer,
   MergeActiveLayers,
   AddLayer,
-  RemoveLayer
+  RemoveLayer,
+  HistorySettings,
+  UnloadModel
 };
 
 enum class FilePickerActionType { None = 0, Load, Import, Save, Export };
 
 void create_default_settings() {
   json default_settings = {{"stable_diffusion_path_set", false},
-                           {"stable_diffusion_path", ""}};
+                           {"stable_diffusion_path", ""},
+                           {"inpaint_with_webui", false},
+                           {"history_budget_mb", 256}};
 
   fs::create_directories(config_dir); // Create directory if it doesn't exist
 
@@ -315,29 +1105,26 @@ void removeLayers(std::vector<Layer> &vec, const std::vector<int> &indices) {
   // Remove elements at the specified indices
   for (int index : sorted_indices) {
     if (index < vec.size()) { // Ensure the index is within range
+      releaseLayerTexture(&vec[index]);
       vec.erase(vec.begin() + index);
     }
   }
 }
 
-std::string encode_file_to_base64(const std::string &path) {
-  // Open the file in binary mode
-  std::ifstream file(path, std::ios::binary);
+void appendToString(void *context, void *data, int size) {
+  ((std::string *)context)->append((const char *)data, size);
+}
 
-  // Check if the file was opened successfully
-  if (!file) {
-    throw std::runtime_error("Unable to open file: " + path);
+// Encodes width x height RGBA pixels as a PNG in memory, then to base64.
+// Empty if encoding fails.
+std::string encode_png_to_base64(const unsigned char *image_data, int width,
+                                 int height) {
+  std::string png;
+  if (!stbi_write_png_to_func(appendToString, &png, width, height, 4,
+                              image_data, width * 4)) {
+    return std::string();
   }
-
-  // Read the file contents into a stringstream
-  std::ostringstream oss;
-  oss << file.rdbuf();
-
-  // Get the file contents as a string
-  std::string file_contents = oss.str();
-
-  // Encode the file contents to base64
-  return base64::to_base64(file_contents);
+  return base64::to_base64(png);
 }
 
 void save_png(const std::string &filename, const unsigned char *image_data,
@@ -368,6 +1155,11 @@ bool loadLayersFromFile(std::vector<Layer> &layers,
   // Read the number of layers
   uint32_t layerCount;
   inFile.read(reinterpret_cast<char *>(&layerCount), sizeof(layerCount));
+
+  for (auto &layer : layers) {
+    releaseLayerTexture(&layer);
+  }
+  layers.clear();
   layers.resize(layerCount);
 
   for (int i = 0; i < layers.size(); i++) {
@@ -377,33 +1169,21 @@ bool loadLayersFromFile(std::vector<Layer> &layers,
     inFile.read(reinterpret_cast<char *>(&width), sizeof(width));
     inFile.read(reinterpret_cast<char *>(&height), sizeof(height));
 
-    layers[i].width = width;
-    layers[i].height = height;
-
     inFile.read(reinterpret_cast<char *>(&layers[i].enabled),
                 sizeof(layers[i].enabled));
+    layers[i].id = newLayerId();
 
-    // Allocate buffer for pixel data
-    std::vector<unsigned char> pixels(layers[i].height * layers[i].width *
-                                      4); // Assuming RGBA format
-
-    // Read pixel data from file
-    inFile.read(reinterpret_cast<char *>(pixels.data()), pixels.size());
+    // Allocate tiles for pixel data
+    allocateLayerTiles(&layers[i], width, height);
 
-    // Create and bind texture
-
-    glGenTextures(1, &(layers[i].layerData));
-    glBindTexture(GL_TEXTURE_2D, layers[i].layerData);
-
-    // Upload pixel data to texture
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    // Upload pixels into texture
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, layers[i].width, layers[i].height,
-                 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
-
-    // Store texture ID in the layer
+    // Read pixel data from file one row at a time; the texture is created when
+    // the layer is displayed
+    std::vector<unsigned char> row(width * 4); // Assuming RGBA format
+    for (int y = 0; y < height; y++) {
+      inFile.read(reinterpret_cast<char *>(row.data()), row.size());
+      writeLayerRow(&layers[i], 0, y, width, row.data());
+    }
+    compactLayerTiles(&layers[i]);
   }
 
   inFile.close();
@@ -446,27 +1226,20 @@ bool saveLayersToFile(const std::vector<Layer> &layers,
     outFile.write(reinterpret_cast<const char *>(&layer.enabled),
                   sizeof(layer.enabled));
 
-    // Bind the texture and read pixel data
-    glBindTexture(GL_TEXTURE_2D, layer.layerData);
-
-    // Allocate buffer for pixel data
-    std::vector<unsigned char> pixels(layer.height * layer.width *
-                                      4); // Assuming RGBA format
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
-
-    // Write pixel data to file
-    outFile.write(reinterpret_cast<const char *>(pixels.data()), pixels.size());
+    // Write pixel data to file one row at a time
+    std::vector<unsigned char> row(layer.width * 4);
+    for (int y = 0; y < layer.height; y++) {
+      readLayerRow(layer, 0, y, layer.width, row.data());
+      outFile.write(reinterpret_cast<const char *>(row.data()), row.size());
+    }
   }
 
   outFile.close();
   return true;
 }
 
-// Simple helper function to load an image into a OpenGL texture with common
-// settings
-bool LoadTextureFromMemory(const void *data, size_t data_size,
-                           GLuint *out_texture, int *out_width,
-                           int *out_height) {
+// Simple helper function to decode an image into a layer's pixels
+bool LoadLayerFromMemory(const void *data, size_t data_size, Layer *out_layer) {
   // Load from file
   int image_width = 0;
   int image_height = 0;
@@ -476,31 +1249,14 @@ bool LoadTextureFromMemory(const void *data, size_t data_size,
   if (image_data == NULL)
     return false;
 
-  // Create a OpenGL texture identifier
-  GLuint image_texture;
-  glGenTextures(1, &image_texture);
-  glBindTexture(GL_TEXTURE_2D, image_texture);
-
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  // Upload pixels into texture
-  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image_width, image_height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, image_data);
+  layerFromBuffer(out_layer, image_data, image_width, image_height);
   stbi_image_free(image_data);
 
-  *out_texture = image_texture;
-  *out_width = image_width;
-  *out_height = image_height;
-
   return true;
 }
 
-// Open and read a file, then forward to LoadTextureFromMemory()
-bool LoadTextureFromFile(const char *file_name, GLuint *out_texture,
-                         int *out_width, int *out_height) {
+// Open and read a file, then forward to LoadLayerFromMemory()
+bool LoadLayerFromFile(const char *file_name, Layer *out_layer) {
   FILE *f = fopen(file_name, "rb");
   if (f == NULL)
     return false;
@@ -511,155 +1267,705 @@ bool LoadTextureFromFile(const char *file_name, GLuint *out_texture,
   fseek(f, 0, SEEK_SET);
   void *file_data = IM_ALLOC(file_size);
   fread(file_data, 1, file_size, f);
-  bool ret = LoadTextureFromMemory(file_data, file_size, out_texture, out_width,
-                                   out_height);
+  bool ret = LoadLayerFromMemory(file_data, file_size, out_layer);
   IM_FREE(file_data);
   return ret;
 }
 
-bool SetPixelColor(GLuint texture_id, int x, int y, unsigned char r,
-                   unsigned char g, unsigned char b, unsigned char a, int width,
-                   int height) {
-  // Check for valid coordinates
-  if (x < 0 || x >= width || y < 0 || y >= height) {
-    return false; // Invalid coordinates
+// Coverage mask of a round brush dab, (2 * radius + 1) pixels square.
+struct BrushStamp {
+  int radius = 0;
+  float falloff = 1.0f;
+  std::vector<unsigned char> coverage;
+};
+
+// Coverage (0-255) of a brush at a distance from its centre line.
+inline unsigned char brushCoverage(const BrushStamp &stamp, float distance) {
+  float coverage = std::clamp(
+      (stamp.radius + 0.5f - distance) / stamp.falloff, 0.0f, 1.0f);
+  return (unsigned char)(coverage * 255 + 0.5f);
+}
+
+// Returns the cached stamp for a radius and hardness (0 = soft, 1 = hard).
+// The edge is anti-aliased over one pixel at full hardness and fades over
+// the whole radius at zero hardness.
+const BrushStamp &getBrushStamp(int radius, float hardness) {
+  static std::map<std::pair<int, int>, BrushStamp> cache;
+
+  int hardnessKey = (int)(std::clamp(hardness, 0.0f, 1.0f) * 100 + 0.5f);
+  std::pair<int, int> key(radius, hardnessKey);
+  auto found = cache.find(key);
+  if (found != cache.end())
+    return found->second;
+
+  // Dragging the sliders would otherwise leave a stamp per step behind.
+  if (cache.size() >= 64)
+    cache.clear();
+
+  BrushStamp &stamp = cache[key];
+  int size = 2 * radius + 1;
+  stamp.radius = radius;
+  stamp.falloff = radius * (1.0f - hardnessKey / 100.0f) + 1.0f;
+  stamp.coverage.resize((size_t)size * size);
+  for (int y = -radius; y <= radius; y++) {
+    for (int x = -radius; x <= radius; x++) {
+      stamp.coverage[(y + radius) * size + x + radius] =
+          brushCoverage(stamp, std::sqrt((float)(x * x + y * y)));
+    }
   }
+  return stamp;
+}
 
-  // Create a buffer to hold the pixel data
-  unsigned char pixel_data[4] = {r, g, b, a};
+void beginStroke(Stroke *stroke) {
+  stroke->base.clear();
+  stroke->coverage.clear();
+}
 
-  // Bind the texture
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+void endStroke(Stroke *stroke) { beginStroke(stroke); }
 
-  // Update the specific pixel
-  glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE,
-                  pixel_data);
+// Straight-alpha source-over of color (0-255 per channel) at the given
+// opacity (0-1) onto base, written to dst.
+inline void sourceOverPixel(unsigned char *dst, const unsigned char *base,
+                            const float *color, float opacity) {
+  float baseAlpha = base[3] / 255.0f;
+  float outAlpha = opacity + baseAlpha * (1.0f - opacity);
+  if (outAlpha <= 0.0f) {
+    std::memcpy(dst, base, 4);
+    return;
+  }
+  float srcWeight = opacity / outAlpha;
+  float baseWeight = 1.0f - srcWeight;
+
+#if defined(__SSE2__) || defined(_M_X64)
+  int packed;
+  std::memcpy(&packed, base, 4);
+  __m128i zero = _mm_setzero_si128();
+  __m128i baseInt = _mm_unpacklo_epi16(
+      _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+  __m128 out =
+      _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(color), _mm_set1_ps(srcWeight)),
+                 _mm_mul_ps(_mm_cvtepi32_ps(baseInt), _mm_set1_ps(baseWeight)));
+  __m128i rounded = _mm_cvtps_epi32(out);
+  rounded = _mm_packs_epi32(rounded, rounded);
+  rounded = _mm_packus_epi16(rounded, rounded);
+  packed = _mm_cvtsi128_si32(rounded);
+  std::memcpy(dst, &packed, 4);
+#else
+  for (int c = 0; c < 3; c++)
+    dst[c] =
+        (unsigned char)(color[c] * srcWeight + base[c] * baseWeight + 0.5f);
+#endif
+  dst[3] = (unsigned char)(outAlpha * 255 + 0.5f);
+}
 
-  return true;
+// x / 255 rounded to nearest, exact for x <= 255 * 255.
+inline unsigned div255(unsigned x) {
+  x += 128;
+  return (x + (x >> 8)) >> 8;
 }
 
-// Helper function to blend a color with an existing pixel
-void blendPixel(std::vector<uint8_t> &buffer, int width, int height, int x,
-                int y, int r, int g, int b, int alpha) {
-  if (x < 0 || x >= width || y < 0 || y >= height)
-    return;                        // Out of bounds check
-  int index = (y * width + x) * 4; // Assuming RGBA format
-
-  // Read the existing color
-  uint8_t existingR = buffer[index];
-  uint8_t existingG = buffer[index + 1];
-  uint8_t existingB = buffer[index + 2];
-  uint8_t existingA = buffer[index + 3];
-
-  // Blend the new color with the existing color
-  float newAlpha = alpha / 255.0f;
-  float invAlpha = 1.0f - newAlpha;
-
-  buffer[index] =
-      static_cast<uint8_t>(r); // * newAlpha + existingR * invAlpha); // Red
-  buffer[index + 1] =
-      static_cast<uint8_t>(g); //* newAlpha + existingG * invAlpha); // Green
-  buffer[index + 2] =
-      static_cast<uint8_t>(b); //* newAlpha + existingB * invAlpha); // Blue
-  buffer[index + 3] =
-      static_cast<uint8_t>(alpha); // std::max(static_cast<int>(alpha),
-                                   // static_cast<int>(existingA))); // Alpha
-                                   // (use the maximum of new and existing)
-}
-
-bool drawCircle(GLuint texture_id, int centerX, int centerY, int image_width,
-                int image_height, int radius, int r, int g, int b, int alpha) {
-  // Create a buffer for the pixel data (RGBA format)
-  std::vector<uint8_t> pixel_buffer(image_width * image_height * 4,
-                                    0); // Initialize with transparent black
-
-  // Bind the texture and read current pixel data into the buffer
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                pixel_buffer.data());
+#if defined(__SSE2__) || defined(_M_X64)
+inline __m128i div255Epu16(__m128i x) {
+  x = _mm_add_epi16(x, _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+#endif
 
-  // Compute radius squared once for efficiency
-  int radius_squared = radius * radius;
+// Source-over of the straight-alpha colour paint at alpha[i] onto straight
+// base pixel i, written to dst pixel i. Pixels whose alpha is zero are left
+// as they are in dst. The result is a lerp from base to paint by the
+// paint's share of the output alpha, so each pixel needs one division.
+void strokeRowScalar(unsigned char *dst, const unsigned char *base,
+                     const unsigned char *alpha, const unsigned char *paint,
+                     int count) {
+  for (int i = 0; i < count; i++, dst += 4, base += 4) {
+    unsigned a = alpha[i];
+    if (a == 0)
+      continue;
+    unsigned outAlpha = a + div255(base[3] * (255 - a));
+    unsigned weight = (a * 255 + outAlpha / 2) / outAlpha;
+    for (int c = 0; c < 3; c++)
+      dst[c] = div255(paint[c] * weight + base[c] * (255 - weight));
+    dst[3] = outAlpha;
+  }
+}
 
-  // Loop through the bounding box of the circle
-  for (int x = -radius; x <= radius; ++x) {
-    int y_max = std::sqrt(radius_squared - x * x);
-    for (int y = -y_max; y <= y_max; ++y) {
-      // Compute the pixel position
-      int pixelX = centerX + x;
-      int pixelY = centerY + y;
+#if defined(__SSE2__) || defined(_M_X64)
+// Two pixels widened to 16 bits per channel, with each pixel's weight and
+// output alpha repeated across its lanes.
+inline __m128i strokePixelsSSE2(__m128i colour, __m128i b, __m128i weight,
+                                __m128i outAlpha) {
+  const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  __m128i mixed = div255Epu16(_mm_add_epi16(
+      _mm_mullo_epi16(colour, weight),
+      _mm_mullo_epi16(b, _mm_sub_epi16(_mm_set1_epi16(255), weight))));
+  return _mm_or_si128(_mm_andnot_si128(alphaLanes, mixed),
+                      _mm_and_si128(alphaLanes, outAlpha));
+}
 
-      // Check if the pixel is within the image bounds
-      if (pixelX >= 0 && pixelX < image_width && pixelY >= 0 &&
-          pixelY < image_height) {
-        // Blend the pixel color in the buffer
-        blendPixel(pixel_buffer, image_width, image_height, pixelX, pixelY, r,
-                   g, b, alpha);
-      }
-    }
+// Four pixels at a time. The weights are found in 32-bit lanes, where the
+// 16-bit kernels work unchanged on the low halves and a float division of
+// integers this small truncates to the same result as the integer division
+// in strokeRowScalar.
+void strokeRowSSE2(unsigned char *dst, const unsigned char *base,
+                   const unsigned char *alpha, const unsigned char *paint,
+                   int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi32(255);
+  const __m128i colour = _mm_set_epi16(0, paint[2], paint[1], paint[0], 0,
+                                       paint[2], paint[1], paint[0]);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    int packed;
+    std::memcpy(&packed, alpha + i, 4);
+    if (packed == 0)
+      continue;
+    __m128i a = _mm_unpacklo_epi16(
+        _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    __m128i b = _mm_loadu_si128((const __m128i *)(base + i * 4));
+    __m128i outAlpha = _mm_add_epi32(
+        a, div255Epu16(_mm_mullo_epi16(_mm_srli_epi32(b, 24),
+                                       _mm_sub_epi32(full, a))));
+    __m128i numerator = _mm_add_epi32(_mm_mullo_epi16(a, full),
+                                      _mm_srli_epi32(outAlpha, 1));
+    __m128i divisor = _mm_max_epi16(outAlpha, _mm_set1_epi32(1));
+    __m128i weight = _mm_cvttps_epi32(_mm_div_ps(
+        _mm_cvtepi32_ps(numerator), _mm_cvtepi32_ps(divisor)));
+
+    weight = _mm_or_si128(weight, _mm_slli_epi32(weight, 16));
+    outAlpha = _mm_or_si128(outAlpha, _mm_slli_epi32(outAlpha, 16));
+    __m128i lo = strokePixelsSSE2(colour, _mm_unpacklo_epi8(b, zero),
+                                  _mm_unpacklo_epi32(weight, weight),
+                                  _mm_unpacklo_epi32(outAlpha, outAlpha));
+    __m128i hi = strokePixelsSSE2(colour, _mm_unpackhi_epi8(b, zero),
+                                  _mm_unpackhi_epi32(weight, weight),
+                                  _mm_unpackhi_epi32(outAlpha, outAlpha));
+
+    __m128i keep = _mm_cmpeq_epi32(a, zero);
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 4));
+    __m128i out = _mm_or_si128(_mm_and_si128(keep, d),
+                               _mm_andnot_si128(keep,
+                                                _mm_packus_epi16(lo, hi)));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), out);
   }
 
-  // Update the texture from the buffer
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGBA,
-                  GL_UNSIGNED_BYTE, pixel_buffer.data());
-
+  strokeRowScalar(dst + i * 4, base + i * 4, alpha + i, paint, count - i);
+}
+#endif
+
+void strokeRow(unsigned char *dst, const unsigned char *base,
+               const unsigned char *alpha, const unsigned char *paint,
+               int count) {
+#if defined(__SSE2__) || defined(_M_X64)
+  strokeRowSSE2(dst, base, alpha, paint, count);
+#else
+  strokeRowScalar(dst, base, alpha, paint, count);
+#endif
+}
+
+// Destination-out at alpha[i]: dst pixel i gets the colour of base pixel i
+// and its alpha scaled by 1 - alpha[i] / 255. Pixels whose alpha is zero
+// are left as they are in dst.
+void eraseRow(unsigned char *dst, const unsigned char *base,
+              const unsigned char *alpha, int count) {
+  for (int i = 0; i < count; i++, dst += 4, base += 4) {
+    if (alpha[i] == 0)
+      continue;
+    std::memcpy(dst, base, 3);
+    dst[3] = div255(base[3] * (255 - alpha[i]));
+  }
+}
+
+// Adds coverage[0 .. x2 - x1) to the stroke for pixels x1 .. x2 - 1 of row
+// y. The span must lie inside the layer.
+void strokeSpan(Layer *layer, Stroke *stroke, int y, int x1, int x2,
+                const unsigned char *coverage, const float *color) {
+  // Tiles the span only grazes with zero coverage are left untouched.
+  while (x1 < x2 && coverage[0] == 0) {
+    x1++;
+    coverage++;
+  }
+  while (x2 > x1 && coverage[x2 - x1 - 1] == 0)
+    x2--;
+
+  unsigned char paint[4];
+  for (int c = 0; c < 4; c++)
+    paint[c] = (unsigned char)(color[c] + 0.5f);
+  int ty = y / TILE_SIZE;
+  int rowOffset = (y - ty * TILE_SIZE) * TILE_SIZE;
+
+  // The part of the span in each tile is blended as one row. Pixels the span
+  // doesn't raise the coverage of get zero alpha, which the row kernels
+  // skip. uniformRow stands in for the pixels of a uniform base tile.
+  unsigned char alpha[TILE_SIZE];
+  unsigned char uniformRow[TILE_SIZE * 4];
+
+  for (int x = x1; x < x2;) {
+    int tx = x / TILE_SIZE;
+    int end = min(x2, (tx + 1) * TILE_SIZE);
+    int index = ty * layer->tilesX + tx;
+    Tile &tile = layer->tiles[index];
+
+    // The first touch of a tile keeps a reference to its pre-stroke pixels;
+    // materializing then copies the block instead of writing into it.
+    auto base = stroke->base.find(index);
+    if (base == stroke->base.end())
+      base = stroke->base.emplace(index, tile).first;
+    const Tile &baseTile = base->second;
+
+    std::vector<unsigned char> &strokeCoverage = stroke->coverage[index];
+    if (strokeCoverage.empty())
+      strokeCoverage.assign(TILE_SIZE * TILE_SIZE, 0);
+
+    materializeTile(&tile);
+    tile.dirty = true;
+
+    // Only [lo, hi) of the run has pixels whose coverage the span raises.
+    int first = rowOffset + x - tx * TILE_SIZE;
+    int lo = end - x;
+    int hi = 0;
+    for (int i = 0; i < end - x; i++) {
+      unsigned char dab = coverage[x - x1 + i];
+      alpha[i] = 0;
+      if (dab <= strokeCoverage[first + i])
+        continue;
+      strokeCoverage[first + i] = dab;
+      alpha[i] = div255(paint[3] * dab);
+      lo = min(lo, i);
+      hi = i + 1;
+    }
+
+    if (lo < hi) {
+      const unsigned char *basePixels = uniformRow;
+      if (baseTile.pixels) {
+        basePixels = baseTile.pixels->data() + (first + lo) * 4;
+      } else {
+        for (int i = 0; i < hi - lo; i++)
+          std::memcpy(uniformRow + i * 4, baseTile.color, 4);
+      }
+      unsigned char *pixels = tile.pixels->data() + (first + lo) * 4;
+      if (stroke->erase)
+        eraseRow(pixels, basePixels, alpha + lo, hi - lo);
+      else
+        strokeRow(pixels, basePixels, alpha + lo, paint, hi - lo);
+    }
+    x = end;
+  }
+}
+
+// Adds one dab of the stamp centred on (centerX, centerY) to the stroke.
+void stampBrush(Layer *layer, Stroke *stroke, const BrushStamp &stamp,
+                int centerX, int centerY, const float *color) {
+  int radius = stamp.radius;
+  int size = 2 * radius + 1;
+  int x1 = max(0, centerX - radius);
+  int y1 = max(0, centerY - radius);
+  int x2 = min(layer->width, centerX + radius + 1);
+  int y2 = min(layer->height, centerY + radius + 1);
+  if (x1 >= x2 || y1 >= y2)
+    return;
+
+  for (int y = y1; y < y2; y++) {
+    const unsigned char *stampRow = stamp.coverage.data() +
+                                    (y - centerY + radius) * size + x1 -
+                                    centerX + radius;
+    strokeSpan(layer, stroke, y, x1, x2, stampRow, color);
+  }
+}
+
+// Narrows [*lo, *hi] to the x for which a + b * x lies in [minValue,
+// maxValue].
+static void clipLinearSpan(float a, float b, float minValue, float maxValue,
+                           float *lo, float *hi) {
+  if (b == 0.0f) {
+    if (a < minValue || a > maxValue) {
+      *lo = 1.0f;
+      *hi = 0.0f;
+    }
+    return;
+  }
+  float x1 = (minValue - a) / b;
+  float x2 = (maxValue - a) / b;
+  if (x1 > x2)
+    std::swap(x1, x2);
+  *lo = std::max(*lo, x1);
+  *hi = std::min(*hi, x2);
+}
+
+// Widens [*lo, *hi] by the part of row y inside a circle.
+static void addCircleSpan(float centerX, float centerY, float radius, float y,
+                          float *lo, float *hi) {
+  float dy = y - centerY;
+  if (dy * dy > radius * radius)
+    return;
+  float half = std::sqrt(radius * radius - dy * dy);
+  *lo = std::min(*lo, centerX - half);
+  *hi = std::max(*hi, centerX + half);
+}
+
+// Adds the capsule swept by the brush from (x1, y1) to (x2, y2) to the
+// stroke. Each row of the capsule is one span, so every pixel is written at
+// most once however long the segment or large the brush.
+void strokeSegment(Layer *layer, Stroke *stroke, const BrushStamp &stamp,
+                   int x1, int y1, int x2, int y2, const float *color) {
+  float reach = stamp.radius + 0.5f;
+  float dx = (float)(x2 - x1);
+  float dy = (float)(y2 - y1);
+  float lengthSquared = dx * dx + dy * dy;
+  float length = std::sqrt(lengthSquared);
+
+  int rowBegin = max(0, (int)std::floor(min(y1, y2) - reach));
+  int rowEnd = min(layer->height, (int)std::ceil(max(y1, y2) + reach) + 1);
+  std::vector<unsigned char> coverage;
+
+  for (int y = rowBegin; y < rowEnd; y++) {
+    float lo = (float)layer->width;
+    float hi = -1.0f;
+    addCircleSpan((float)x1, (float)y1, reach, (float)y, &lo, &hi);
+    addCircleSpan((float)x2, (float)y2, reach, (float)y, &lo, &hi);
+
+    // The band between the end caps: within reach of the line and
+    // projecting onto the segment.
+    if (lengthSquared > 0.0f) {
+      float bandLo = 0.0f;
+      float bandHi = (float)(layer->width - 1);
+      float across = dx * (y - y1) + dy * x1;
+      float along = dy * (y - y1) - dx * x1;
+      clipLinearSpan(across, -dy, -reach * length, reach * length, &bandLo,
+                     &bandHi);
+      clipLinearSpan(along, dx, 0.0f, lengthSquared, &bandLo, &bandHi);
+      if (bandLo <= bandHi) {
+        lo = std::min(lo, bandLo);
+        hi = std::max(hi, bandHi);
+      }
+    }
+
+    int spanBegin = max(0, (int)std::ceil(lo));
+    int spanEnd = min(layer->width, (int)std::floor(hi) + 1);
+    if (spanBegin >= spanEnd)
+      continue;
+
+    coverage.resize(spanEnd - spanBegin);
+    for (int x = spanBegin; x < spanEnd; x++) {
+      float px = (float)(x - x1);
+      float py = (float)(y - y1);
+      float t = 0.0f;
+      if (lengthSquared > 0.0f)
+        t = std::clamp((px * dx + py * dy) / lengthSquared, 0.0f, 1.0f);
+      float ox = px - t * dx;
+      float oy = py - t * dy;
+      coverage[x - spanBegin] =
+          brushCoverage(stamp, std::sqrt(ox * ox + oy * oy));
+    }
+    strokeSpan(layer, stroke, y, spanBegin, spanEnd, coverage.data(), color);
+  }
+}
+
+bool drawCircle(Layer *layer, Stroke *stroke, int centerX, int centerY,
+                int radius, float hardness, int r, int g, int b, int alpha) {
+  float color[4] = {(float)r, (float)g, (float)b, (float)alpha};
+  stampBrush(layer, stroke, getBrushStamp(radius, hardness), centerX, centerY,
+             color);
   return true;
 }
 
-bool drawLine(GLuint texture_id, int start_x, int start_y, int end_x, int end_y,
-              int image_width, int image_height, int radius, int r, int g,
+bool drawLine(Layer *layer, Stroke *stroke, int start_x, int start_y,
+              int end_x, int end_y, int radius, float hardness, int r, int g,
               int b, int alpha) {
+  float color[4] = {(float)r, (float)g, (float)b, (float)alpha};
+  strokeSegment(layer, stroke, getBrushStamp(radius, hardness), start_x,
+                start_y, end_x, end_y, color);
+  return true;
+}
 
-  // Create a buffer for the pixel data (RGBA format)
-  std::vector<uint8_t> pixel_buffer(image_width * image_height * 4,
-                                    0); // Initialize with transparent black
+// Brush input recorded by the GLFW callbacks, in layer coordinates.
+enum class StrokeEventType { Begin, Move, End };
+
+struct StrokeEvent {
+  StrokeEventType type = StrokeEventType::Move;
+  float x = 0.0f;
+  float y = 0.0f;
+  // Begin only: the layer and brush the stroke paints with
+  int layerId = 0;
+  int radius = 1;
+  float hardness = 1.0f;
+  int color[4] = {0, 0, 0, 255};
+  bool erase = false;
+};
 
-  // Bind the texture and read current pixel data into the buffer
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                pixel_buffer.data());
+const size_t STROKE_QUEUE_SIZE = 4096;
+
+// Lock-free single-producer single-consumer ring of stroke events. The UI
+// thread pushes from the input callbacks and the raster thread pops. The
+// raster thread sleeps on `wake` while it has nothing to do.
+struct StrokeQueue {
+  StrokeEvent events[STROKE_QUEUE_SIZE];
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+  std::mutex wakeMutex;
+  std::condition_variable wake;
+};
 
-  float pixel_dist = sqrt(pow(end_x - start_x, 2) + pow(end_y - start_y, 2));
+// Taking the mutex orders the notify after the waiter's last check, so a
+// wake-up can't slip in between the check and the wait.
+void wakeStrokeQueue(StrokeQueue *queue) {
+  { std::lock_guard<std::mutex> lock(queue->wakeMutex); }
+  queue->wake.notify_one();
+}
 
-  int radius_squared = radius * radius;
+// Moves leave two slots free and a Begin one, so the End of a stroke always
+// finds room and the input callbacks never have to wait for the raster
+// thread, which may itself be waiting on the UI thread.
+bool pushStrokeEvent(StrokeQueue *queue, const StrokeEvent &event) {
+  size_t reserve = 0;
+  if (event.type == StrokeEventType::Move)
+    reserve = 2;
+  else if (event.type == StrokeEventType::Begin)
+    reserve = 1;
+  size_t tail = queue->tail.load(std::memory_order_relaxed);
+  size_t queued = tail - queue->head.load(std::memory_order_acquire);
+  if (queued + reserve >= STROKE_QUEUE_SIZE)
+    return false;
+  queue->events[tail % STROKE_QUEUE_SIZE] = event;
+  queue->tail.store(tail + 1, std::memory_order_release);
+  wakeStrokeQueue(queue);
+  return true;
+}
 
-  for (int i = 0; i < (int)pixel_dist; i++) {
+bool popStrokeEvent(StrokeQueue *queue, StrokeEvent *event) {
+  size_t head = queue->head.load(std::memory_order_relaxed);
+  if (head == queue->tail.load(std::memory_order_acquire))
+    return false;
+  *event = queue->events[head % STROKE_QUEUE_SIZE];
+  queue->head.store(head + 1, std::memory_order_release);
+  return true;
+}
 
-    float coefficient = (float)i / pixel_dist;
+// Paints queued brush input into the layers on its own thread, so strokes
+// follow every cursor sample rather than one per frame. It holds
+// canvasMutex while it touches the layers; the UI thread holds it for the
+// rest of the frame and only uploads the tiles the strokes dirtied.
+//
+// Each finished stroke is its own undo entry, so the next stroke isn't
+// started until the UI thread has committed the last one and caught up
+// committedStrokes with finishedStrokes.
+struct StrokeRasterizer {
+  StrokeQueue queue;
+  std::vector<Layer> *layers = nullptr;
+  std::mutex *canvasMutex = nullptr;
+  std::atomic<bool> running{false};
+  std::atomic<int> finishedStrokes{0};
+  std::atomic<int> committedStrokes{0};
+  std::thread thread;
+
+  // Raster thread only
+  StrokeEvent held; // a Begin waiting for the last stroke to be committed
+  bool holding = false;
+  Stroke stroke;
+  StrokeEvent brush; // the Begin event of the current stroke
+  bool stroking = false;
+  int lastX = 0;
+  int lastY = 0;
+  int width = 0; // layer size when the stroke's tiles were recorded
+  int height = 0;
+};
 
-    int candidate_x = start_x * (1 - coefficient) + end_x * (coefficient);
-    int candidate_y = start_y * (1 - coefficient) + end_y * (coefficient);
+void rasterStrokeEvent(StrokeRasterizer *rasterizer, const StrokeEvent &event) {
+  if (event.type == StrokeEventType::Begin) {
+    rasterizer->brush = event;
+    rasterizer->stroke.erase = event.erase;
+    rasterizer->stroking = true;
+    rasterizer->width = -1;
+  }
+  if (!rasterizer->stroking)
+    return;
+  if (event.type == StrokeEventType::End) {
+    endStroke(&rasterizer->stroke);
+    rasterizer->stroking = false;
+    rasterizer->finishedStrokes++;
+    return;
+  }
 
-    for (int x = -radius; x <= radius; ++x) {
-      int y_max = std::sqrt(radius_squared - x * x);
-      for (int y = -y_max; y <= y_max; ++y) {
-        // Compute the pixel position
-        int pixelX = candidate_x + x;
-        int pixelY = candidate_y + y;
+  int index = findLayerIndex(*rasterizer->layers, rasterizer->brush.layerId);
+  if (index == -1)
+    return;
+  Layer *layer = &(*rasterizer->layers)[index];
+
+  // A resize mid-stroke replaces the tile grid the stroke refers to.
+  if (layer->width != rasterizer->width ||
+      layer->height != rasterizer->height) {
+    beginStroke(&rasterizer->stroke);
+    rasterizer->width = layer->width;
+    rasterizer->height = layer->height;
+  }
 
-        // Check if the pixel is within the image bounds
-        if (pixelX >= 0 && pixelX < image_width && pixelY >= 0 &&
-            pixelY < image_height) {
-          // Blend the pixel color in the buffer
-          blendPixel(pixel_buffer, image_width, image_height, pixelX, pixelY, r,
-                     g, b, alpha);
-        }
-      }
-    }
+  const StrokeEvent &brush = rasterizer->brush;
+  int x = (int)std::floor(event.x);
+  int y = (int)std::floor(event.y);
+  if (event.type == StrokeEventType::Begin) {
+    drawCircle(layer, &rasterizer->stroke, x, y, brush.radius, brush.hardness,
+               brush.color[0], brush.color[1], brush.color[2],
+               brush.color[3]);
+  } else if (x != rasterizer->lastX || y != rasterizer->lastY) {
+    drawLine(layer, &rasterizer->stroke, rasterizer->lastX, rasterizer->lastY,
+             x, y, brush.radius, brush.hardness, brush.color[0],
+             brush.color[1], brush.color[2], brush.color[3]);
   }
+  rasterizer->lastX = x;
+  rasterizer->lastY = y;
+}
 
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGBA,
-                  GL_UNSIGNED_BYTE, pixel_buffer.data());
+bool strokeCommitted(StrokeRasterizer *rasterizer) {
+  return rasterizer->committedStrokes == rasterizer->finishedStrokes;
+}
 
+// The next event to paint, if it may be painted now.
+bool nextStrokeEvent(StrokeRasterizer *rasterizer, StrokeEvent *event) {
+  if (rasterizer->holding) {
+    if (!strokeCommitted(rasterizer))
+      return false;
+    rasterizer->holding = false;
+    *event = rasterizer->held;
+    return true;
+  }
+  if (!popStrokeEvent(&rasterizer->queue, event))
+    return false;
+  if (event->type == StrokeEventType::Begin && !strokeCommitted(rasterizer)) {
+    rasterizer->held = *event;
+    rasterizer->holding = true;
+    return false;
+  }
   return true;
 }
 
-bool drawSelectionBox(GLuint texture_id, int x1, int y1, int x2, int y2,
-                      int image_width, int image_height, int radius, int r,
-                      int g, int b, int alpha, bool fill) {
-  // Create a buffer for the pixel data (RGBA format) and initialize with
-  // transparent black
-  std::vector<uint8_t> pixel_buffer(image_width * image_height * 4, 0);
+bool strokeEventReady(StrokeRasterizer *rasterizer) {
+  if (rasterizer->holding)
+    return strokeCommitted(rasterizer);
+  StrokeQueue &queue = rasterizer->queue;
+  return queue.head.load(std::memory_order_relaxed) !=
+         queue.tail.load(std::memory_order_acquire);
+}
+
+void runStrokeRasterizer(StrokeRasterizer *rasterizer) {
+  StrokeEvent event;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> wait(rasterizer->queue.wakeMutex);
+      while (rasterizer->running && !strokeEventReady(rasterizer))
+        rasterizer->queue.wake.wait(wait);
+    }
+    if (!rasterizer->running)
+      return;
+
+    // Paint what has queued up, handing the layers back to the UI between
+    // batches.
+    std::lock_guard<std::mutex> lock(*rasterizer->canvasMutex);
+    for (int i = 0; i < 64 && nextStrokeEvent(rasterizer, &event); i++)
+      rasterStrokeEvent(rasterizer, event);
+  }
+}
+
+// Called by the UI thread, holding canvasMutex, once the strokes finished so
+// far are in the history.
+void commitStrokes(StrokeRasterizer *rasterizer, int finishedStrokes) {
+  if (rasterizer->committedStrokes != finishedStrokes) {
+    rasterizer->committedStrokes = finishedStrokes;
+    wakeStrokeQueue(&rasterizer->queue);
+  }
+}
+
+void startStrokeRasterizer(StrokeRasterizer *rasterizer,
+                           std::vector<Layer> *layers, std::mutex *mutex) {
+  rasterizer->layers = layers;
+  rasterizer->canvasMutex = mutex;
+  rasterizer->running = true;
+  rasterizer->thread = std::thread(runStrokeRasterizer, rasterizer);
+}
+
+void stopStrokeRasterizer(StrokeRasterizer *rasterizer) {
+  rasterizer->running = false;
+  wakeStrokeQueue(&rasterizer->queue);
+  if (rasterizer->thread.joinable())
+    rasterizer->thread.join();
+}
+
+// Where the canvas is on screen and what a click on it paints. The UI thread
+// refreshes it every frame; the GLFW input callbacks read it on the same
+// thread while events are polled.
+struct CanvasInput {
+  StrokeQueue *queue = nullptr;
+  bool hovered = false;
+  float originX = 0.0f;
+  float originY = 0.0f;
+  float scale = 1.0f;
+  int layerId = -1;
+  int width = 0;
+  int height = 0;
+  struct BrushState brush;
+  bool stroking = false;
+};
+
+CanvasInput canvasInput;
+
+StrokeEvent canvasEvent(StrokeEventType type, double x, double y) {
+  StrokeEvent event;
+  event.type = type;
+  event.x = (float)((x - canvasInput.originX) / canvasInput.scale);
+  event.y = (float)((y - canvasInput.originY) / canvasInput.scale);
+  return event;
+}
+
+void canvasCursorPosCallback(GLFWwindow *window, double x, double y) {
+  if (!canvasInput.stroking)
+    return;
+  // When the queue is full the sample is dropped and the next one joins up
+  // with the last painted position.
+  pushStrokeEvent(canvasInput.queue,
+                  canvasEvent(StrokeEventType::Move, x, y));
+}
+
+void canvasMouseButtonCallback(GLFWwindow *window, int button, int action,
+                               int mods) {
+  if (button != GLFW_MOUSE_BUTTON_LEFT)
+    return;
+
+  double x, y;
+  glfwGetCursorPos(window, &x, &y);
+
+  if (action == GLFW_PRESS && !canvasInput.stroking && canvasInput.hovered &&
+      canvasInput.layerId != -1 && !(mods & GLFW_MOD_CONTROL)) {
+    StrokeEvent event = canvasEvent(StrokeEventType::Begin, x, y);
+    if (event.x < 0 || event.y < 0 || event.x >= canvasInput.width ||
+        event.y >= canvasInput.height)
+      return;
+
+    const BrushState &brush = canvasInput.brush;
+    event.layerId = canvasInput.layerId;
+    event.radius = brush.radius;
+    event.hardness = brush.hardness;
+    for (int c = 0; c < 4; c++)
+      event.color[c] = (int)(brush.RGBA[c] * 255);
+    event.erase = brush.erase;
+    // A full queue means the raster thread is far behind; the click is
+    // dropped rather than stalling input.
+    canvasInput.stroking = pushStrokeEvent(canvasInput.queue, event);
+  } else if (action == GLFW_RELEASE && canvasInput.stroking) {
+    pushStrokeEvent(canvasInput.queue,
+                    canvasEvent(StrokeEventType::End, x, y));
+    canvasInput.stroking = false;
+  }
+}
+
+bool drawSelectionBox(Layer *layer, int x1, int y1, int x2, int y2,
+                      int radius, int r, int g, int b, int alpha, bool fill) {
+  int image_width = layer->width;
+  int image_height = layer->height;
+
+  // Reset the layer to transparent black
+  for (auto &tile : layer->tiles) {
+    fillTile(&tile, 0, 0, 0, 0);
+  }
 
   // Ensure x1 <= x2 and y1 <= y2
   if (x1 > x2)
@@ -681,39 +1987,25 @@ bool drawSelectionBox(GLuint texture_id, int x1, int y1, int x2, int y2,
                         dx1 * dx1 + dy1 * dy1 <= radius * radius);
 
       if (fill || is_border) {
-        // Overwrite the pixel color in the buffer
-        int pixel_index = (y * image_width + x) * 4;
-        pixel_buffer[pixel_index + 0] = r;     // Red
-        pixel_buffer[pixel_index + 1] = g;     // Green
-        pixel_buffer[pixel_index + 2] = b;     // Blue
-        pixel_buffer[pixel_index + 3] = alpha; // Alpha
+        // Overwrite the pixel color in the layer
+        unsigned char *pixel = layerPixel(layer, x, y);
+        pixel[0] = r;     // Red
+        pixel[1] = g;     // Green
+        pixel[2] = b;     // Blue
+        pixel[3] = alpha; // Alpha
       }
     }
   }
 
-  // Bind the texture
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-
-  // Upload the modified pixel buffer back to the texture
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGBA,
-                  GL_UNSIGNED_BYTE, pixel_buffer.data());
+  markLayerDirty(layer, 0, 0, image_width, image_height);
 
   return true;
 }
 
-bool drawBox(GLuint texture_id, int x1, int y1, int x2, int y2, int image_width,
-             int image_height, int radius, int r, int g, int b, int alpha,
-             bool fill) {
-  // Create a buffer for the original pixel data (RGBA format)
-  std::vector<uint8_t> original_pixel_buffer(image_width * image_height * 4);
-
-  // Bind the texture and get the current pixel data
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                original_pixel_buffer.data());
-
-  // Create a buffer for the updated pixel data
-  std::vector<uint8_t> updated_pixel_buffer = original_pixel_buffer;
+bool drawBox(Layer *layer, int x1, int y1, int x2, int y2, int radius, int r,
+             int g, int b, int alpha, bool fill) {
+  int image_width = layer->width;
+  int image_height = layer->height;
 
   // Ensure x1 <= x2 and y1 <= y2
   if (x1 > x2)
@@ -735,187 +2027,112 @@ bool drawBox(GLuint texture_id, int x1, int y1, int x2, int y2, int image_width,
                         dx1 * dx1 + dy1 * dy1 <= radius * radius);
 
       if (fill || is_border) {
-        // Update the pixel color in the buffer
-        int pixel_index = (y * image_width + x) * 4;
-        updated_pixel_buffer[pixel_index + 0] = r;     // Red
-        updated_pixel_buffer[pixel_index + 1] = g;     // Green
-        updated_pixel_buffer[pixel_index + 2] = b;     // Blue
-        updated_pixel_buffer[pixel_index + 3] = alpha; // Alpha
+        // Update the pixel color in the layer
+        unsigned char *pixel = layerPixel(layer, x, y);
+        pixel[0] = r;     // Red
+        pixel[1] = g;     // Green
+        pixel[2] = b;     // Blue
+        pixel[3] = alpha; // Alpha
       }
     }
   }
 
-  // Bind the texture
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-
-  // Upload the modified pixel buffer back to the texture
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGBA,
-                  GL_UNSIGNED_BYTE, updated_pixel_buffer.data());
+  markLayerDirty(layer, x1, y1, x2 + 1, y2 + 1);
 
   return true;
 }
 
-bool copyTextureSubset(GLuint *in_texture, GLuint *out_texture, int width,
-                       int height, int x1, int y1, int x2, int y2) {
-  // Allocate memory for the texture data
-  unsigned char *image_data = new unsigned char[width * height * 4]; // RGBA
-
-  glBindTexture(GL_TEXTURE_2D, *in_texture);
-
-  // Read the pixel data from the texture
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image_data);
-
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
-
+bool copyLayerSubset(const Layer &in_layer, Layer *out_layer, int x1, int y1,
+                     int x2, int y2) {
   int dst_width = x2 - x1;
   int dst_height = y2 - y1;
 
-  unsigned char *cropped_image_data =
-      new unsigned char[dst_width * dst_height * 4];
+  allocateLayerTiles(out_layer, dst_width, dst_height);
 
-  // Transfer pixel values to cropped_image_data
+  // Transfer pixel values row by row
+  std::vector<unsigned char> row(dst_width * 4);
   for (int y = 0; y < dst_height; ++y) {
-    for (int x = 0; x < dst_width; ++x) {
-      int src_index = ((y1 + y) * width + (x1 + x)) * 4;
-      int dst_index = (y * dst_width + x) * 4;
-      cropped_image_data[dst_index] = image_data[src_index];
-      cropped_image_data[dst_index + 1] = image_data[src_index + 1];
-      cropped_image_data[dst_index + 2] = image_data[src_index + 2];
-      cropped_image_data[dst_index + 3] = image_data[src_index + 3];
-    }
+    readLayerRow(in_layer, x1, y1 + y, dst_width, row.data());
+    writeLayerRow(out_layer, 0, y, dst_width, row.data());
   }
-
-  // Create an OpenGL texture identifier
-  GLuint texture_id;
-  glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  // Upload pixels into texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, dst_width, dst_height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, cropped_image_data);
-
-  // Free the allocated image data
-  delete[] image_data;
-  delete[] cropped_image_data;
-
-  *out_texture = texture_id;
+  compactLayerTiles(out_layer);
 
   return true;
 }
 
-bool resizeTexture(GLuint *in_texture, int dst_width, int dst_height) {
-  // Bind the input texture
-  glBindTexture(GL_TEXTURE_2D, *in_texture);
-
-  // Get the original texture dimensions
-  GLint src_width, src_height;
-  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &src_width);
-  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &src_height);
+bool resizeLayer(Layer *layer, int dst_width, int dst_height) {
+  int src_width = layer->width;
+  int src_height = layer->height;
 
-  // Allocate memory for the original texture data
-  unsigned char *image_data =
-      new unsigned char[src_width * src_height * 4]; // RGBA
-
-  // Read the pixel data from the texture
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image_data);
+  Layer resized;
+  allocateLayerTiles(&resized, dst_width, dst_height);
 
-  // Allocate memory for the resized texture data
-  unsigned char *resized_image_data =
-      new unsigned char[dst_width * dst_height * 4];
-
-  // Resize the texture using nearest neighbor interpolation
+  // Resize the layer using nearest neighbor interpolation
   for (int y = 0; y < dst_height; ++y) {
     for (int x = 0; x < dst_width; ++x) {
-      // Calculate the corresponding pixel in the original texture
+      // Calculate the corresponding pixel in the original layer
       int src_x = static_cast<int>(x * src_width / dst_width);
       int src_y = static_cast<int>(y * src_height / dst_height);
 
-      // Clamp the indices to the original texture dimensions
+      // Clamp the indices to the original layer dimensions
       src_x = std::min(src_x, src_width - 1);
       src_y = std::min(src_y, src_height - 1);
 
-      // Get the pixel values from the original texture
-      unsigned char *p = &image_data[(src_y * src_width + src_x) * 4];
+      // Get the pixel values from the original layer
+      const unsigned char *p = layerPixel(*layer, src_x, src_y);
 
-      // Copy the pixel values to the resized texture
-      for (int c = 0; c < 4; ++c) {
-        resized_image_data[(y * dst_width + x) * 4 + c] = p[c];
-      }
+      // Copy the pixel values to the resized layer
+      std::memcpy(layerPixel(&resized, x, y), p, 4);
     }
   }
+  compactLayerTiles(&resized);
 
-  // Upload pixels into the original texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, dst_width, dst_height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, resized_image_data);
-
-  // Free the allocated image data
-  delete[] image_data;
-  delete[] resized_image_data;
+  releaseLayerTexture(layer);
+  layer->tiles.swap(resized.tiles);
+  layer->width = dst_width;
+  layer->height = dst_height;
+  layer->tilesX = resized.tilesX;
+  layer->tilesY = resized.tilesY;
 
   return true;
 }
 
-bool copyTextureToRegion(GLuint *in_texture, GLuint *out_texture, int src_width,
-                         int src_height, int dst_width, int dst_height,
-                         int x_offset, int y_offset, bool overwrite) {
-  // Allocate memory for the texture data
-  unsigned char *image_data =
-      new unsigned char[src_width * src_height * 4]; // RGBA
-
-  glBindTexture(GL_TEXTURE_2D, *in_texture);
-
-  // Read the pixel data from the texture
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image_data);
-
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
-
-  unsigned char *result_image_data =
-      new unsigned char[dst_width * dst_height * 4];
+bool copyLayerToRegion(const Layer &in_layer, Layer *out_layer, int x_offset,
+                       int y_offset, bool overwrite) {
+  int src_width = in_layer.width;
+  int src_height = in_layer.height;
+  int dst_width = out_layer->width;
+  int dst_height = out_layer->height;
 
-  glBindTexture(GL_TEXTURE_2D, *out_texture);
-
-  // Read the pixel data from the texture
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, result_image_data);
-
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
-
-  // Transfer pixel values to cropped_image_data
+  // Transfer pixel values into the destination layer
   for (int y = 0; y < src_height; ++y) {
     for (int x = 0; x < src_width; ++x) {
 
-      int src_index = (y * src_width + x) * 4;
-      int dst_index = ((y_offset + y) * dst_width + (x_offset + x)) * 4;
-      if (dst_index >= 0 && dst_index < dst_width * dst_height * 4 &&
-          y_offset + y < dst_height && x_offset + x < dst_width &&
+      if (y_offset + y < dst_height && x_offset + x < dst_width &&
           y_offset + y >= 0 && x_offset + x >= 0) {
 
+        const unsigned char *src = layerPixel(in_layer, x, y);
+        unsigned char *dst = layerPixel(out_layer, x_offset + x, y_offset + y);
+
         // Read alpha values (normalized to [0, 1])
-        float newAlpha = image_data[src_index + 3] / 255.0f;
-        float oldAlpha = result_image_data[dst_index + 3] / 255.0f;
+        float newAlpha = src[3] / 255.0f;
+        float oldAlpha = dst[3] / 255.0f;
 
         // Read color values
-        float srcRed = image_data[src_index + 0];
-        float srcGreen = image_data[src_index + 1];
-        float srcBlue = image_data[src_index + 2];
+        float srcRed = src[0];
+        float srcGreen = src[1];
+        float srcBlue = src[2];
 
-        float dstRed = result_image_data[dst_index + 0];
-        float dstGreen = result_image_data[dst_index + 1];
-        float dstBlue = result_image_data[dst_index + 2];
+        float dstRed = dst[0];
+        float dstGreen = dst[1];
+        float dstBlue = dst[2];
 
         // If newAlpha is 0, copy the source pixel directly
         if (oldAlpha == 0 || overwrite) {
-          result_image_data[dst_index + 0] = srcRed;
-          result_image_data[dst_index + 1] = srcGreen;
-          result_image_data[dst_index + 2] = srcBlue;
-          result_image_data[dst_index + 3] =
-              static_cast<unsigned char>(newAlpha * 255.0f);
+          dst[0] = srcRed;
+          dst[1] = srcGreen;
+          dst[2] = srcBlue;
+          dst[3] = static_cast<unsigned char>(newAlpha * 255.0f);
         } else {
           // Blending using alpha compositing
           float blendedAlpha = newAlpha + oldAlpha * (1 - newAlpha);
@@ -931,204 +2148,653 @@ bool copyTextureToRegion(GLuint *in_texture, GLuint *out_texture, int src_width,
               blendedAlpha;
 
           // Clamp the color values to [0, 255]
-          result_image_data[dst_index + 0] =
+          dst[0] =
               static_cast<unsigned char>(std::clamp(blendedRed, 0.0f, 255.0f));
-          result_image_data[dst_index + 1] = static_cast<unsigned char>(
+          dst[1] = static_cast<unsigned char>(
               std::clamp(blendedGreen, 0.0f, 255.0f));
-          result_image_data[dst_index + 2] =
+          dst[2] =
               static_cast<unsigned char>(std::clamp(blendedBlue, 0.0f, 255.0f));
-          result_image_data[dst_index + 3] = static_cast<unsigned char>(
+          dst[3] = static_cast<unsigned char>(
               std::clamp(blendedAlpha * 255.0f, 0.0f, 255.0f));
         }
       }
     }
   }
 
-  // Create an OpenGL texture identifier
-  GLuint texture_id;
-  glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
-
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  // Upload pixels into texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, dst_width, dst_height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, result_image_data);
-
-  // Free the allocated image data
-  delete[] image_data;
-  delete[] result_image_data;
-
-  *out_texture = texture_id;
+  markLayerDirty(out_layer, x_offset, y_offset, x_offset + src_width,
+                 y_offset + src_height);
 
   return true;
 }
 
-bool GenerateTexture(ProgramState *state, GLuint *out_texture,
-                     std::string prompt_string, int width, int height,
-                     std::string model_path) {
+// The loaded stable-diffusion context, kept resident between generations:
+// loading the weights takes far longer than sampling an image. It is
+// rebuilt only when one of the parameters it was created from changes.
+struct ModelCache {
+  sd_ctx_t *ctx = nullptr;
+  SDParams params;
+};
 
-  int sd_channels = 3;
+ModelCache modelCache;
+
+// True when a context created for a can be used for b. A context that
+// decodes in tiles also serves small images, so growing and shrinking the
+// generation size doesn't reload the model each time.
+bool sameModel(const SDParams &a, const SDParams &b) {
+  return a.model_path == b.model_path && a.vae_path == b.vae_path &&
+         a.taesd_path == b.taesd_path &&
+         a.controlnet_path == b.controlnet_path &&
+         a.lora_model_dir == b.lora_model_dir &&
+         a.embeddings_path == b.embeddings_path &&
+         a.stacked_id_embeddings_path == b.stacked_id_embeddings_path &&
+         (a.vae_tiling || !b.vae_tiling) && a.n_threads == b.n_threads &&
+         a.wtype == b.wtype && a.rng_type == b.rng_type &&
+         a.schedule == b.schedule && a.clip_on_cpu == b.clip_on_cpu &&
+         a.control_net_cpu == b.control_net_cpu &&
+         a.vae_on_cpu == b.vae_on_cpu;
+}
 
-  SDParams params;
+void unloadModel(ModelCache *cache) {
+  if (cache->ctx != nullptr) {
+    free_sd_ctx(cache->ctx);
+    cache->ctx = nullptr;
+  }
+}
 
-  params.model_path = model_path;
-  params.prompt = prompt_string; //"insidious spiders and octopus";
-  params.sample_steps = 20;
-  params.seed = std::rand();
+// Returns a context for params, loading the model if the cached context was
+// built from different parameters. Null if loading fails.
+sd_ctx_t *acquireModel(ModelCache *cache, const SDParams &params) {
+  if (cache->ctx != nullptr && sameModel(cache->params, params)) {
+    return cache->ctx;
+  }
+  unloadModel(cache);
 
-  sd_ctx_t *sd_ctx = new_sd_ctx(
+  // The weights must outlive the first generation, so they are not freed
+  // after use. The VAE encoder is kept for img2img.
+  cache->ctx = new_sd_ctx(
       params.model_path.c_str(), params.vae_path.c_str(),
       params.taesd_path.c_str(), params.controlnet_path.c_str(),
       params.lora_model_dir.c_str(), params.embeddings_path.c_str(),
-      params.stacked_id_embeddings_path.c_str(), true, params.vae_tiling, true,
-      params.n_threads, params.wtype, params.rng_type, params.schedule,
-      params.clip_on_cpu, params.control_net_cpu, params.vae_on_cpu);
+      params.stacked_id_embeddings_path.c_str(), false, params.vae_tiling,
+      false, params.n_threads, params.wtype, params.rng_type,
+      params.schedule, params.clip_on_cpu, params.control_net_cpu,
+      params.vae_on_cpu);
+  cache->params = params;
+  return cache->ctx;
+}
 
-  sd_image_t *results;
-  sd_image_t *control_image = NULL;
+// Box blur of count values spaced stride apart, in place. Values past the
+// ends repeat the edge value.
+void boxBlurLine(unsigned char *data, int count, int stride, int radius,
+                 std::vector<int> &scratch) {
+  for (int i = 0; i < count; i++) {
+    scratch[i] = data[i * stride];
+  }
+  int window = 2 * radius + 1;
+  int sum = 0;
+  for (int k = -radius; k <= radius; k++) {
+    sum += scratch[min(max(k, 0), count - 1)];
+  }
+  for (int i = 0; i < count; i++) {
+    data[i * stride] = (unsigned char)((sum + window / 2) / window);
+    sum += scratch[min(i + radius + 1, count - 1)];
+    sum -= scratch[max(i - radius, 0)];
+  }
+}
 
-  results =
-      txt2img(sd_ctx, params.prompt.c_str(), params.negative_prompt.c_str(),
-              params.clip_skip, params.cfg_scale, params.width, params.height,
-              params.sample_method, params.sample_steps, params.seed,
-              params.batch_count, control_image, params.control_strength,
-              params.style_ratio, params.normalize_input,
-              params.input_id_images_path.c_str());
+// Mask blur, as in webui, so the inpainted pixels fade into the original.
+const int INPAINT_MASK_BLUR = 4;
+
+// One byte per pixel of the overlay: 255 where it has been painted, then
+// box blurred by radius.
+std::vector<unsigned char> inpaintMask(const Layer &overlay, int radius) {
+  int width = overlay.width;
+  int height = overlay.height;
+  std::vector<unsigned char> pixels = layerToBuffer(overlay);
+  std::vector<unsigned char> mask(width * height);
+  for (int i = 0; i < width * height; i++) {
+    const unsigned char *pixel = pixels.data() + i * 4;
+    mask[i] = (pixel[0] || pixel[1] || pixel[2]) ? 255 : 0;
+  }
 
-  if (sd_ctx == NULL) {
-    printf("new_sd_ctx_t failed\n");
-    return 1;
+  if (radius > 0 && width > 0 && height > 0) {
+    std::vector<int> scratch(max(width, height));
+    for (int y = 0; y < height; y++) {
+      boxBlurLine(mask.data() + y * width, width, 1, radius, scratch);
+    }
+    for (int x = 0; x < width; x++) {
+      boxBlurLine(mask.data() + x, height, width, radius, scratch);
+    }
   }
+  return mask;
+}
 
-  // Allocate memory for the random texture data
-  unsigned char *image_data = new unsigned char[512 * 512 * 4]; // RGBA
+// The part of a layer an inpaint is sampled from: the mask's bounding box
+// with context around it, grown in 64 pixel steps while the layer allows.
+struct InpaintRegion {
+  int x = 0;
+  int y = 0;
+  int width = 0;
+  int height = 0;
+};
 
-  // Seed the random number generator
+// Pixels of unmasked context kept on each side of the mask, and the
+// smallest crop side, so the model sees enough of the surroundings to match
+// them.
+const int INPAINT_CONTEXT = 64;
+const int INPAINT_MIN_SIZE = 256;
+
+// Grows the masked range first .. last of an axis of the given size by the
+// context, rounds it up to a multiple of 64 and centers it, shifted to stay
+// inside 0 .. size.
+void growInpaintSpan(int first, int last, int size, int *start,
+                     int *length) {
+  int span = max(last - first + 1 + 2 * INPAINT_CONTEXT, INPAINT_MIN_SIZE);
+  span = min((span + 63) / 64 * 64, size);
+  int center = (first + last + 1) / 2;
+  *start = min(max(center - span / 2, 0), size - span);
+  *length = span;
+}
 
-  // Fill the image data with random values
-  // for (int i = 0; i < width * height * 4; ++i)
-  // {
-  //     image_data[i] = static_cast<unsigned char>(std::rand() % 256);
-  // }
+// Finds the region to sample for a width x height mask. False if nothing
+// is masked.
+bool findInpaintRegion(const std::vector<unsigned char> &mask, int width,
+                       int height, InpaintRegion *region) {
+  int x1 = width;
+  int y1 = height;
+  int x2 = -1;
+  int y2 = -1;
+  for (int y = 0; y < height; y++) {
+    const unsigned char *row = mask.data() + y * width;
+    int first = 0;
+    while (first < width && row[first] == 0) {
+      first++;
+    }
+    if (first == width) {
+      continue;
+    }
+    int last = width - 1;
+    while (row[last] == 0) {
+      last--;
+    }
+    x1 = min(x1, first);
+    x2 = max(x2, last);
+    y1 = min(y1, y);
+    y2 = y;
+  }
+  if (x2 < 0) {
+    return false;
+  }
+
+  growInpaintSpan(x1, x2, width, &region->x, &region->width);
+  growInpaintSpan(y1, y2, height, &region->y, &region->height);
+  return true;
+}
+
+// The region's pixels of the layer, as RGBA.
+std::vector<unsigned char> cropLayer(const Layer &layer,
+                                     const InpaintRegion &region) {
+  std::vector<unsigned char> data(region.width * region.height * 4);
+  for (int y = 0; y < region.height; y++) {
+    readLayerRow(layer, region.x, region.y + y, region.width,
+                 data.data() + y * region.width * 4);
+  }
+  return data;
+}
+
+// The region's part of a mask that is width pixels wide.
+std::vector<unsigned char> cropMask(const std::vector<unsigned char> &mask,
+                                    int width, const InpaintRegion &region) {
+  std::vector<unsigned char> data(region.width * region.height);
+  for (int y = 0; y < region.height; y++) {
+    std::memcpy(data.data() + y * region.width,
+                mask.data() + (region.y + y) * width + region.x,
+                region.width);
+  }
+  return data;
+}
+
+// Composites rgb over the region of the layer with the mask as opacity;
+// both are region-sized. Only the masked span of each row is read and
+// written. Returns false if the region no longer fits the layer.
+bool pasteInpaintResult(Layer *layer, const unsigned char *rgb,
+                        const unsigned char *mask,
+                        const InpaintRegion &region) {
+  int width = region.width;
+  int height = region.height;
+  if (region.x + width > layer->width || region.y + height > layer->height) {
+    return false;
+  }
 
-  for (int i = 0; i < 512; i++) {
-    for (int c = 0; c < 512; c++) {
-      int dst_offset = i * 512 * 4 + c * 4;
-      int src_offset = i * 512 * 3 + c * 3;
+  std::vector<unsigned char> row(width * 4);
+  for (int y = 0; y < height; y++) {
+    const unsigned char *maskRow = mask + y * width;
+    int x1 = 0;
+    while (x1 < width && maskRow[x1] == 0) {
+      x1++;
+    }
+    if (x1 == width) {
+      continue;
+    }
+    int x2 = width;
+    while (maskRow[x2 - 1] == 0) {
+      x2--;
+    }
 
-      image_data[dst_offset] = results->data[src_offset];
-      image_data[dst_offset + 1] = results->data[src_offset + 1];
-      image_data[dst_offset + 2] = results->data[src_offset + 2];
-      image_data[dst_offset + 3] = 255;
+    readLayerRow(*layer, region.x + x1, region.y + y, x2 - x1, row.data());
+    for (int x = x1; x < x2; x++) {
+      if (maskRow[x] == 0) {
+        continue;
+      }
+      const unsigned char *src = rgb + (y * width + x) * 3;
+      float color[4] = {(float)src[0], (float)src[1], (float)src[2], 255.0f};
+      unsigned char *pixel = row.data() + (x - x1) * 4;
+      sourceOverPixel(pixel, pixel, color, maskRow[x] / 255.0f);
     }
+    writeLayerRow(layer, region.x + x1, region.y + y, x2 - x1, row.data());
   }
+  compactLayerTiles(layer);
+  return true;
+}
 
-  unsigned char *rescaled_image = (unsigned char *)malloc(width * height * 4);
-  stbir_resize_uint8(image_data, 512, 512, 0, rescaled_image, width, height, 0,
-                     4);
+// A txt2img or img2img run on a worker thread, so the editor stays
+// interactive while the model samples. The UI thread starts it with
+// startGeneration or startInpaint and picks up the result with
+// finishGeneration; until `finished` is set the worker owns everything but
+// the atomics.
+struct GenerationJob {
+  std::thread thread;
+  std::atomic<bool> running{false};
+  std::atomic<bool> finished{false};
+  std::atomic<bool> cancelled{false};
+  std::atomic<int> step{0};
+  std::atomic<int> steps{0};
 
-  // Create an OpenGL texture identifier
-  GLuint texture_id;
-  glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  SDParams params;
+  SDMode mode = TXT2IMG;
+  // Size of the result and the layer it is written to
+  int width = 0;
+  int height = 0;
+  int layerId = 0;
+
+  // img2img only: the region of the layer that is sampled, and the layer's
+  // size when the run started. The region's pixels as RGBA, its part of the
+  // inpaint mask with one byte per pixel, and the generated RGB are all
+  // width x height.
+  InpaintRegion region;
+  int layerWidth = 0;
+  int layerHeight = 0;
+  std::vector<unsigned char> initImage;
+  std::vector<unsigned char> mask;
+  std::vector<unsigned char> generated;
+
+  bool succeeded = false;
+  // Why a run that didn't succeed failed, shown to the user
+  std::string error;
+  // Tiles of each image, built on the worker and swapped into the target
+  std::vector<Layer> results;
+  // RGBA previews of each image when more than one was sampled
+  std::vector<std::vector<unsigned char>> thumbnails;
+  int thumbnailWidth = 0;
+  int thumbnailHeight = 0;
+};
 
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+GenerationJob generationJob;
 
-  // Upload pixels into texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, rescaled_image);
+const int CANDIDATE_THUMBNAIL_SIZE = 160;
 
-  // Free the allocated image data
-  delete[] image_data;
+// A batch waiting for the user to pick the image that goes into the layer.
+struct GenerationCandidates {
+  int layerId = 0;
+  std::vector<Layer> layers;
+  std::vector<TextureHandle> thumbnails;
+  int thumbnailWidth = 0;
+  int thumbnailHeight = 0;
+};
 
-  *out_texture = texture_id;
+GenerationCandidates generationCandidates;
 
-  free_sd_ctx(sd_ctx);
+void generationProgress(int step, int steps, float time, void *data) {
+  GenerationJob *job = (GenerationJob *)data;
+  job->step = step;
+  job->steps = steps;
+}
 
-  return true;
+// Free images returned by txt2img/img2img.
+void freeSdImages(sd_image_t *images, int count) {
+  for (int i = 0; i < count; i++) {
+    free(images[i].data);
+  }
+  free(images);
 }
 
-bool copyTexture(GLuint *in_texture, GLuint *out_texture, int width,
-                 int height) {
-  // Allocate memory for the random texture data
-  unsigned char *image_data = new unsigned char[width * height * 4]; // RGBA
+// Worker thread body.
+void GenerateTexture(GenerationJob *job) {
+  const SDParams &params = job->params;
+  int width = job->width;
+  int height = job->height;
 
-  // Seed the random number generator
+  sd_ctx_t *sd_ctx = acquireModel(&modelCache, params);
+  if (sd_ctx == NULL) {
+    printf("new_sd_ctx_t failed\n");
+    job->error = "Couldn't load the model " + params.model_path + ".";
+    job->finished = true;
+    return;
+  }
 
-  glBindTexture(GL_TEXTURE_2D, *in_texture);
+  sd_image_t *results;
+  sd_image_t *control_image = NULL;
 
-  // Allocate the buffer to hold the pixel data
-  // image_data.resize(width * height * 4); // Assuming RGBA format with 4
-  // channels (4 bytes per pixel)
+  sd_set_progress_callback(generationProgress, job);
+  if (job->mode == IMG2IMG) {
+    // The layer is scaled to the sampling size and packed to RGB in place
+    std::vector<unsigned char> init(params.width * params.height * 4);
+    stbir_resize_uint8(job->initImage.data(), width, height, 0, init.data(),
+                       params.width, params.height, 0, 4);
+    for (int i = 0; i < params.width * params.height; i++) {
+      init[i * 3] = init[i * 4];
+      init[i * 3 + 1] = init[i * 4 + 1];
+      init[i * 3 + 2] = init[i * 4 + 2];
+    }
+    sd_image_t init_image = {(uint32_t)params.width, (uint32_t)params.height,
+                             3, init.data()};
+    results =
+        img2img(sd_ctx, init_image, params.prompt.c_str(),
+                params.negative_prompt.c_str(), params.clip_skip,
+                params.cfg_scale, params.width, params.height,
+                params.sample_method, params.sample_steps, params.strength,
+                params.seed, 1, control_image, params.control_strength,
+                params.style_ratio, params.normalize_input,
+                params.input_id_images_path.c_str());
+  } else {
+    results =
+        txt2img(sd_ctx, params.prompt.c_str(), params.negative_prompt.c_str(),
+                params.clip_skip, params.cfg_scale, params.width,
+                params.height, params.sample_method, params.sample_steps,
+                params.seed, params.batch_count, control_image,
+                params.control_strength, params.style_ratio,
+                params.normalize_input, params.input_id_images_path.c_str());
+  }
+  sd_set_progress_callback(NULL, NULL);
 
-  // Read the pixel data from the texture
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, image_data);
+  if (results == NULL) {
+    printf(job->mode == IMG2IMG ? "img2img failed\n" : "txt2img failed\n");
+    job->error = "Sampling failed; the console may say why.";
+    job->finished = true;
+    return;
+  }
 
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
+  // The inpaint result goes back at the layer's size and is blended in by
+  // the mask on the UI thread
+  if (job->mode == IMG2IMG) {
+    const sd_image_t &image = results[0];
+    job->generated.resize(width * height * 3);
+    stbir_resize_uint8(image.data, image.width, image.height, 0,
+                       job->generated.data(), width, height, 0, 3);
+    freeSdImages(results, 1);
+    job->succeeded = true;
+    job->finished = true;
+    return;
+  }
 
-  // Fill the image data with random values
-  // for (int i = 0; i < width * height * 4; ++i)
-  // {
-  //     image_data[i] = static_cast<unsigned char>(std::rand() % 256);
-  // }
+  int count = params.batch_count;
+  int thumbnailWidth = CANDIDATE_THUMBNAIL_SIZE;
+  int thumbnailHeight = CANDIDATE_THUMBNAIL_SIZE;
+  if (width > height) {
+    thumbnailHeight = max(1, CANDIDATE_THUMBNAIL_SIZE * height / width);
+  } else {
+    thumbnailWidth = max(1, CANDIDATE_THUMBNAIL_SIZE * width / height);
+  }
+  job->results.resize(count);
+  job->thumbnails.resize(count > 1 ? count : 0);
+  job->thumbnailWidth = thumbnailWidth;
+  job->thumbnailHeight = thumbnailHeight;
 
-  // Create an OpenGL texture identifier
-  GLuint texture_id;
-  glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  for (int i = 0; i < count; i++) {
+    const sd_image_t &image = results[i];
 
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // Sampling runs at the requested size, so the resize is only a fallback
+    if (image.width == width && image.height == height) {
+      layerFromRgb(&job->results[i], image.data, width, height);
+    } else {
+      std::vector<unsigned char> resized(width * height * 3);
+      stbir_resize_uint8(image.data, image.width, image.height, 0,
+                         resized.data(), width, height, 0, 3);
+      layerFromRgb(&job->results[i], resized.data(), width, height);
+    }
 
-  // Upload pixels into texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, image_data);
+    if (count > 1) {
+      std::vector<unsigned char> small(thumbnailWidth * thumbnailHeight * 3);
+      stbir_resize_uint8(image.data, image.width, image.height, 0,
+                         small.data(), thumbnailWidth, thumbnailHeight, 0, 3);
+      job->thumbnails[i].resize(thumbnailWidth * thumbnailHeight * 4);
+      rgbToRgba(job->thumbnails[i].data(), small.data(),
+                thumbnailWidth * thumbnailHeight);
+    }
+  }
+  freeSdImages(results, count);
 
-  // Free the allocated image data
-  delete[] image_data;
+  job->succeeded = true;
+  job->finished = true;
+}
 
-  *out_texture = texture_id;
+// Sizes the model samples at must be multiples of its 64 pixel latent
+// blocks.
+int snapGenerationSize(int size) { return max(64, (size + 32) / 64 * 64); }
+
+// Images with more pixels than this are VAE-decoded in tiles, which keeps
+// decoder memory bounded at large sizes.
+const int VAE_TILING_PIXELS = 768 * 768;
 
+// Joins a worker left over from the last run. False if one is still going.
+bool prepareGeneration(GenerationJob *job) {
+  if (job->running) {
+    return false;
+  }
+  if (job->thread.joinable()) {
+    job->thread.join();
+  }
   return true;
 }
 
-bool GenerateEmptyTexture(GLuint *out_texture, int width, int height) {
-  // Allocate memory for the random texture data
-  unsigned char *image_data = new unsigned char[width * height * 4]; // RGBA
+void launchGeneration(GenerationJob *job) {
+  job->succeeded = false;
+  job->error.clear();
+  job->step = 0;
+  job->steps = job->params.sample_steps;
+  job->cancelled = false;
+  job->finished = false;
+  job->running = true;
+  job->thread = std::thread(GenerateTexture, job);
+}
 
-  // Seed the random number generator
+// Samples at width x height, snapped to multiples of 64. Returns false if a
+// generation is already running.
+bool startGeneration(GenerationJob *job, const SDParams &params, int width,
+                     int height, int layerId) {
+  if (!prepareGeneration(job)) {
+    return false;
+  }
 
-  // Fill the image data with random values
-  for (int i = 0; i < width * height * 4; ++i) {
-    image_data[i] = static_cast<unsigned char>(0);
+  job->params = params;
+  job->mode = TXT2IMG;
+  job->width = snapGenerationSize(width);
+  job->height = snapGenerationSize(height);
+  job->params.width = job->width;
+  job->params.height = job->height;
+  job->params.vae_tiling = job->width * job->height > VAE_TILING_PIXELS;
+  job->params.batch_count = max(1, params.batch_count);
+  job->layerId = layerId;
+  launchGeneration(job);
+  return true;
+}
+
+// Repaints the masked parts of layer. img2img runs on the region only,
+// scaled to a multiple of 64 if the layer edge cut it short, and the result
+// is blended back by the mask. Returns false if a generation is already
+// running.
+bool startInpaint(GenerationJob *job, const SDParams &params,
+                  const Layer &layer, const std::vector<unsigned char> &mask,
+                  const InpaintRegion &region) {
+  if (!prepareGeneration(job)) {
+    return false;
   }
 
-  // Create an OpenGL texture identifier
-  GLuint texture_id;
-  glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+  job->params = params;
+  job->mode = IMG2IMG;
+  job->width = region.width;
+  job->height = region.height;
+  job->params.width = snapGenerationSize(region.width);
+  job->params.height = snapGenerationSize(region.height);
+  job->params.vae_tiling =
+      job->params.width * job->params.height > VAE_TILING_PIXELS;
+  job->params.batch_count = 1;
+  job->layerId = layer.id;
+  job->region = region;
+  job->layerWidth = layer.width;
+  job->layerHeight = layer.height;
+  job->initImage = cropLayer(layer, region);
+  job->mask = cropMask(mask, layer.width, region);
+  launchGeneration(job);
+  return true;
+}
 
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+// stable-diffusion.cpp can't interrupt a run, so a cancelled job keeps the
+// worker busy until sampling ends and its result is then thrown away.
+void cancelGeneration(GenerationJob *job) { job->cancelled = true; }
 
-  // Upload pixels into texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, image_data);
+void clearGenerationCandidates(GenerationCandidates *candidates) {
+  std::vector<Layer>().swap(candidates->layers);
+  candidates->thumbnails.clear();
+}
 
-  // Free the allocated image data
-  delete[] image_data;
+// Called every frame on the UI thread. A finished, uncancelled single image
+// or inpaint result is written into its target layer, and true returned. A
+// batch replaces the candidates on offer instead. A run that failed, or an
+// inpaint that no longer fits its layer, raises a warning.
+bool finishGeneration(ProgramState *state, GenerationJob *job,
+                      std::vector<Layer> &layers,
+                      GenerationCandidates *candidates) {
+  if (!job->finished) {
+    return false;
+  }
+  job->thread.join();
+  job->finished = false;
+  job->running = false;
+
+  bool applied = false;
+  int index = findLayerIndex(layers, job->layerId);
+  if (!job->succeeded && !job->cancelled) {
+    state->warningDialogOpen = true;
+    state->warningMessage = job->error;
+  }
+  if (job->succeeded && !job->cancelled && index != -1) {
+    if (job->mode == IMG2IMG) {
+      // A layer resized during the run no longer lines up with the region
+      Layer *layer = &layers[index];
+      applied = layer->width == job->layerWidth &&
+                layer->height == job->layerHeight &&
+                pasteInpaintResult(layer, job->generated.data(),
+                                   job->mask.data(), job->region);
+      if (!applied) {
+        state->warningDialogOpen = true;
+        state->warningMessage =
+            "The layer was resized during the inpaint; the result was "
+            "dropped.";
+      }
+    } else if (job->results.size() == 1) {
+      replaceLayerTiles(&layers[index], &job->results[0]);
+      applied = true;
+    } else {
+      clearGenerationCandidates(candidates);
+      candidates->layerId = job->layerId;
+      candidates->layers.swap(job->results);
+      candidates->thumbnailWidth = job->thumbnailWidth;
+      candidates->thumbnailHeight = job->thumbnailHeight;
+      candidates->thumbnails.resize(job->thumbnails.size());
+      for (int i = 0; i < job->thumbnails.size(); i++) {
+        TextureHandle &thumbnail = candidates->thumbnails[i];
+        acquireTexture(&thumbnail, job->thumbnailWidth,
+                       job->thumbnailHeight);
+        uploadTextureRect(&uploadRing, thumbnail.id, 0, 0,
+                          job->thumbnailWidth, job->thumbnailHeight,
+                          job->thumbnails[i].data(), job->thumbnailWidth);
+      }
+      flushUploads(&uploadRing);
+    }
+  }
+  std::vector<Layer>().swap(job->results);
+  std::vector<std::vector<unsigned char>>().swap(job->thumbnails);
+  std::vector<unsigned char>().swap(job->initImage);
+  std::vector<unsigned char>().swap(job->mask);
+  std::vector<unsigned char>().swap(job->generated);
+  return applied;
+}
 
-  *out_texture = texture_id;
+// Shows the candidates of the last batch. Clicking one writes it into the
+// target layer and returns true; the rest are discarded.
+bool showGenerationCandidates(GenerationCandidates *candidates,
+                              std::vector<Layer> &layers) {
+  if (candidates->layers.empty()) {
+    return false;
+  }
 
-  return true;
+  bool chosen = false;
+  bool close = false;
+
+  ImGui::Begin("Choose Image", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+  for (int i = 0; i < candidates->layers.size(); i++) {
+    if (i > 0) {
+      ImGui::SameLine();
+    }
+    ImGui::PushID(i);
+    if (ImGui::ImageButton("candidate",
+                           (void *)(intptr_t)candidates->thumbnails[i].id,
+                           ImVec2(candidates->thumbnailWidth,
+                                  candidates->thumbnailHeight))) {
+      int index = findLayerIndex(layers, candidates->layerId);
+      if (index != -1) {
+        replaceLayerTiles(&layers[index], &candidates->layers[i]);
+        chosen = true;
+      }
+      close = true;
+    }
+    ImGui::PopID();
+  }
+  if (ImGui::Button("Discard")) {
+    close = true;
+  }
+  ImGui::End();
+
+  if (close) {
+    clearGenerationCandidates(candidates);
+  }
+  return chosen;
+}
+
+void showGenerationProgress(GenerationJob *job) {
+  if (!job->running) {
+    return;
+  }
+
+  ImGui::Begin("Generating", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+  int step = job->step;
+  int steps = job->steps;
+  if (job->cancelled) {
+    ImGui::Text("Cancelling; waiting for the current step to finish...");
+  } else {
+    if (step == 0) {
+      ImGui::Text("Loading model...");
+    } else {
+      ImGui::Text("Sampling step %d of %d", step, steps);
+    }
+    ImGui::ProgressBar(steps > 0 ? (float)step / steps : 0.0f,
+                       ImVec2(300, 0));
+    if (ImGui::Button("Cancel")) {
+      cancelGeneration(job);
+    }
+  }
+  ImGui::End();
 }
 
 bool GenerateRandomTexture(GLuint *out_texture, int width, int height) {
@@ -1163,60 +2829,536 @@ bool GenerateRandomTexture(GLuint *out_texture, int width, int height) {
   return true;
 }
 
-bool generateUniformTexture(GLuint *out_texture, int width, int height, int r,
-                            int g, int b, int alpha) {
-  // Allocate memory for the random texture data
-  unsigned char *image_data = new unsigned char[width * height * 4]; // RGBA
+bool generateUniformLayer(Layer *out_layer, int width, int height, int r,
+                          int g, int b, int alpha) {
+  allocateLayerTiles(out_layer, width, height);
 
-  // Seed the random number generator
+  // A uniform layer needs no pixel storage at all
+  for (auto &tile : out_layer->tiles) {
+    fillTile(&tile, r, g, b, alpha);
+  }
 
-  // Fill the image data with random values
-  for (int i = 0; i < width * height * 4; i += 4) {
-    image_data[i] = static_cast<unsigned char>(r);
-    image_data[i + 1] = static_cast<unsigned char>(g);
-    image_data[i + 2] = static_cast<unsigned char>(b);
-    image_data[i + 3] = static_cast<unsigned char>(alpha);
+  return true;
+}
+
+// Undo history. Layers share their tile pixel blocks with the last committed
+// snapshot until they are written to, so an entry is found by comparing block
+// pointers and only holds the tiles that actually changed. Once the history
+// outgrows its memory budget, the oldest tiles are compressed and then moved
+// to a spill file, and are read back when an undo needs them.
+
+// A tile kept by the history. Packed tiles have no raw pixels and hold their
+// zlib-compressed pixels either in memory or in the spill file.
+struct StoredTile {
+  Tile tile;
+  std::vector<unsigned char> packed;
+  long long spillOffset = -1;
+  int spillSize = 0;
+};
+
+// A whole layer kept by the history; layer.tiles is left empty.
+struct StoredLayer {
+  Layer layer;
+  std::vector<StoredTile> tiles;
+};
+
+struct TileDelta {
+  int layerId;
+  int index;
+  StoredTile before;
+  StoredTile after;
+};
+
+struct VisibilityDelta {
+  int layerId;
+  bool before;
+  bool after;
+};
+
+// Layers that were added, removed or resized are recorded whole.
+struct LayerDelta {
+  int layerId;
+  bool existedBefore;
+  bool existsAfter;
+  StoredLayer before;
+  StoredLayer after;
+};
+
+struct HistoryEntry {
+  std::vector<TileDelta> tiles;
+  std::vector<VisibilityDelta> visibility;
+  std::vector<LayerDelta> layers;
+  // Layer ids from bottom to top; only filled in when the order changed.
+  std::vector<int> orderBefore;
+  std::vector<int> orderAfter;
+};
+
+struct History {
+  std::vector<HistoryEntry> entries;
+  // entries[0, cursor) are applied to the layers; the rest can be redone.
+  size_t cursor = 0;
+  // The layers as of the cursor, sharing tiles but not textures.
+  std::vector<Layer> committed;
+
+  // RAM the entries may hold before old tiles are compressed and spilled.
+  size_t budget = 256 * 1024 * 1024;
+  std::fstream spill;
+  long long spillEnd = 0;
+};
+
+// Each running instance spills to its own file, removed when it exits.
+#ifdef SLOP_WINDOWS_BUILD
+const std::string history_spill_file = config_dir + "/history." +
+                                       std::to_string(GetCurrentProcessId()) +
+                                       ".spill";
+#else
+const std::string history_spill_file =
+    config_dir + "/history." + std::to_string(getpid()) + ".spill";
+#endif
+
+// Copy of the layer that shares its tiles but has no texture.
+Layer snapshotLayer(const Layer &layer) {
+  Layer copy = layer;
+  return copy;
+}
+
+std::vector<Layer> snapshotLayers(const std::vector<Layer> &layers) {
+  std::vector<Layer> copies;
+  copies.reserve(layers.size());
+  for (const auto &layer : layers) {
+    copies.push_back(snapshotLayer(layer));
   }
+  return copies;
+}
 
-  // Create an OpenGL texture identifier
-  GLuint texture_id;
-  glGenTextures(1, &texture_id);
-  glBindTexture(GL_TEXTURE_2D, texture_id);
+StoredTile storeTile(const Tile &tile) {
+  StoredTile stored;
+  stored.tile = tile;
+  return stored;
+}
 
-  // Setup filtering parameters for display
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+StoredLayer storeLayer(const Layer &layer) {
+  StoredLayer stored;
+  stored.layer = snapshotLayer(layer);
+  stored.layer.tiles.clear();
+  for (const auto &tile : layer.tiles) {
+    stored.tiles.push_back(storeTile(tile));
+  }
+  return stored;
+}
 
-  // Upload pixels into texture
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, image_data);
+bool tileIsPacked(const StoredTile &stored) {
+  return !stored.packed.empty() || stored.spillOffset != -1;
+}
 
-  // Free the allocated image data
-  delete[] image_data;
+// Get the tile back, reading it from the spill file and decompressing it if
+// it was packed. A tile that can't be read back comes back transparent.
+Tile loadTile(History *history, const StoredTile &stored) {
+  Tile tile = stored.tile;
+  if (!tileIsPacked(stored)) {
+    return tile;
+  }
 
-  *out_texture = texture_id;
+  const std::vector<unsigned char> *packed = &stored.packed;
+  std::vector<unsigned char> paged;
+  bool loaded = true;
+  if (stored.spillOffset != -1) {
+    paged.resize(stored.spillSize);
+    history->spill.clear();
+    history->spill.seekg(stored.spillOffset);
+    history->spill.read(reinterpret_cast<char *>(paged.data()), paged.size());
+    loaded = (bool)history->spill;
+    packed = &paged;
+  }
+
+  tile.pixels =
+      std::make_shared<std::vector<unsigned char>>(TILE_SIZE * TILE_SIZE * 4);
+  if (loaded) {
+    int size = stbi_zlib_decode_buffer(
+        reinterpret_cast<char *>(tile.pixels->data()), tile.pixels->size(),
+        reinterpret_cast<const char *>(packed->data()), packed->size());
+    loaded = size == (int)tile.pixels->size();
+  }
+  if (!loaded) {
+    std::cerr << "Failed to read a tile back from history." << std::endl;
+    tile.pixels.reset();
+    std::memset(tile.color, 0, 4);
+    tile.coverage = TileCoverage::Transparent;
+  }
+  return tile;
+}
+
+Layer loadLayer(History *history, const StoredLayer &stored) {
+  Layer layer = stored.layer;
+  for (const auto &tile : stored.tiles) {
+    layer.tiles.push_back(loadTile(history, tile));
+  }
+  return layer;
+}
+
+bool sameTile(const Tile &a, const Tile &b) {
+  if (a.pixels || b.pixels) {
+    return a.pixels == b.pixels;
+  }
+  return std::memcmp(a.color, b.color, 4) == 0;
+}
+
+// Everything that differs between two states of the layer stack.
+HistoryEntry diffLayers(const std::vector<Layer> &before,
+                        const std::vector<Layer> &after) {
+  HistoryEntry entry;
+
+  for (const auto &old : before) {
+    int index = findLayerIndex(after, old.id);
+    if (index == -1) {
+      entry.layers.push_back(
+          {old.id, true, false, storeLayer(old), StoredLayer()});
+      continue;
+    }
+
+    const Layer &now = after[index];
+    if (now.width != old.width || now.height != old.height) {
+      entry.layers.push_back(
+          {old.id, true, true, storeLayer(old), storeLayer(now)});
+      continue;
+    }
+
+    if (now.enabled != old.enabled) {
+      entry.visibility.push_back({old.id, old.enabled, now.enabled});
+    }
+
+    for (int i = 0; i < old.tiles.size(); i++) {
+      if (!sameTile(old.tiles[i], now.tiles[i])) {
+        entry.tiles.push_back(
+            {old.id, i, storeTile(old.tiles[i]), storeTile(now.tiles[i])});
+      }
+    }
+  }
+
+  for (const auto &now : after) {
+    if (findLayerIndex(before, now.id) == -1) {
+      entry.layers.push_back(
+          {now.id, false, true, StoredLayer(), storeLayer(now)});
+    }
+  }
+
+  std::vector<int> orderBefore;
+  std::vector<int> orderAfter;
+  for (const auto &layer : before) {
+    orderBefore.push_back(layer.id);
+  }
+  for (const auto &layer : after) {
+    orderAfter.push_back(layer.id);
+  }
+  if (orderBefore != orderAfter) {
+    entry.orderBefore.swap(orderBefore);
+    entry.orderAfter.swap(orderAfter);
+  }
 
+  return entry;
+}
+
+bool historyEntryEmpty(const HistoryEntry &entry) {
+  return entry.tiles.empty() && entry.visibility.empty() &&
+         entry.layers.empty() && entry.orderAfter.empty();
+}
+
+// Move the layers to the state before (undo) or after (redo) the entry. Only
+// the tiles the entry touches are marked for upload.
+void applyHistoryEntry(History *history, std::vector<Layer> &layers,
+                       const HistoryEntry &entry, bool undo) {
+  for (const auto &delta : entry.tiles) {
+    Layer &layer = layers[findLayerIndex(layers, delta.layerId)];
+    layer.tiles[delta.index] =
+        loadTile(history, undo ? delta.before : delta.after);
+    layer.tiles[delta.index].dirty = true;
+  }
+
+  for (const auto &delta : entry.visibility) {
+    layers[findLayerIndex(layers, delta.layerId)].enabled =
+        undo ? delta.before : delta.after;
+  }
+
+  for (const auto &delta : entry.layers) {
+    bool exists = undo ? delta.existedBefore : delta.existsAfter;
+    int index = findLayerIndex(layers, delta.layerId);
+    if (index != -1) {
+      releaseLayerTexture(&layers[index]);
+      if (exists) {
+        layers[index] = loadLayer(history, undo ? delta.before : delta.after);
+      } else {
+        layers.erase(layers.begin() + index);
+      }
+    } else if (exists) {
+      layers.push_back(loadLayer(history, undo ? delta.before : delta.after));
+    }
+  }
+
+  const std::vector<int> &order = undo ? entry.orderBefore : entry.orderAfter;
+  if (!order.empty()) {
+    std::vector<Layer> ordered;
+    ordered.reserve(order.size());
+    for (int id : order) {
+      ordered.push_back(layers[findLayerIndex(layers, id)]);
+    }
+    layers.swap(ordered);
+  }
+}
+
+std::vector<StoredTile *> storedTiles(HistoryEntry &entry) {
+  std::vector<StoredTile *> tiles;
+  for (auto &delta : entry.tiles) {
+    tiles.push_back(&delta.before);
+    tiles.push_back(&delta.after);
+  }
+  for (auto &delta : entry.layers) {
+    for (auto &tile : delta.before.tiles) {
+      tiles.push_back(&tile);
+    }
+    for (auto &tile : delta.after.tiles) {
+      tiles.push_back(&tile);
+    }
+  }
+  return tiles;
+}
+
+// Pixel blocks the live layers hold anyway; keeping them costs nothing.
+std::set<const void *> committedBlocks(const History &history) {
+  std::set<const void *> blocks;
+  for (const auto &layer : history.committed) {
+    for (const auto &tile : layer.tiles) {
+      if (tile.pixels) {
+        blocks.insert(tile.pixels.get());
+      }
+    }
+  }
+  return blocks;
+}
+
+// RAM held by the history on top of the live layers.
+size_t historyMemoryUse(History *history) {
+  std::set<const void *> counted = committedBlocks(*history);
+  size_t bytes = 0;
+  for (auto &entry : history->entries) {
+    for (StoredTile *stored : storedTiles(entry)) {
+      bytes += stored->packed.size();
+      if (stored->tile.pixels &&
+          counted.insert(stored->tile.pixels.get()).second) {
+        bytes += stored->tile.pixels->size();
+      }
+    }
+  }
+  return bytes;
+}
+
+bool spillTile(History *history, StoredTile *stored) {
+  if (!history->spill.is_open()) {
+    history->spill.open(history_spill_file, std::ios::in | std::ios::out |
+                                                std::ios::binary |
+                                                std::ios::trunc);
+    if (!history->spill.is_open()) {
+      std::cerr << "Failed to open history spill file." << std::endl;
+      return false;
+    }
+  }
+
+  history->spill.clear();
+  history->spill.seekp(history->spillEnd);
+  history->spill.write(reinterpret_cast<const char *>(stored->packed.data()),
+                       stored->packed.size());
+  if (!history->spill) {
+    return false;
+  }
+
+  stored->spillOffset = history->spillEnd;
+  stored->spillSize = stored->packed.size();
+  history->spillEnd += stored->packed.size();
+  std::vector<unsigned char>().swap(stored->packed);
   return true;
 }
 
-std::vector<Layer> deepCopyLayers(std::vector<Layer> &layers) {
-  std::vector<Layer> copiedLayers;
-  copiedLayers.reserve(layers.size());
+void closeHistorySpill(History *history) {
+  if (history->spill.is_open()) {
+    history->spill.close();
+    std::error_code error;
+    fs::remove(history_spill_file, error);
+  }
+  history->spillEnd = 0;
+}
+
+bool spilledEarlier(const StoredTile *a, const StoredTile *b) {
+  return a->spillOffset < b->spillOffset;
+}
+
+// Reclaim the spill space of tiles whose entries were dropped. Once at least
+// half the file is dead, the live tiles are moved down over the gaps and the
+// file is shrunk; with no live tiles left it is removed.
+void compactHistorySpill(History *history) {
+  std::vector<StoredTile *> spilled;
+  long long live = 0;
+  for (auto &entry : history->entries) {
+    for (StoredTile *stored : storedTiles(entry)) {
+      if (stored->spillOffset != -1) {
+        spilled.push_back(stored);
+        live += stored->spillSize;
+      }
+    }
+  }
+  if (spilled.empty()) {
+    closeHistorySpill(history);
+    return;
+  }
+  if (history->spillEnd - live < live) {
+    return;
+  }
+
+  // Tiles only ever move towards the start, so each is read before anything
+  // is written over it
+  std::sort(spilled.begin(), spilled.end(), spilledEarlier);
+  long long end = 0;
+  std::vector<char> buffer;
+  for (StoredTile *stored : spilled) {
+    if (stored->spillOffset != end) {
+      buffer.resize(stored->spillSize);
+      history->spill.clear();
+      history->spill.seekg(stored->spillOffset);
+      history->spill.read(buffer.data(), buffer.size());
+      history->spill.seekp(end);
+      history->spill.write(buffer.data(), buffer.size());
+      if (!history->spill) {
+        std::cerr << "Failed to compact history spill file." << std::endl;
+        return;
+      }
+      stored->spillOffset = end;
+    }
+    end += stored->spillSize;
+  }
+
+  history->spill.flush();
+  std::error_code error;
+  fs::resize_file(history_spill_file, end, error);
+  history->spillEnd = end;
+}
+
+// Bring the history back under its budget, oldest entries first: raw tiles
+// are compressed, and if that is not enough, compressed tiles are spilled.
+void trimHistory(History *history) {
+  compactHistorySpill(history);
+
+  size_t used = historyMemoryUse(history);
+  if (used <= history->budget) {
+    return;
+  }
 
+  std::set<const void *> live = committedBlocks(*history);
+  // Blocks appear in two neighbouring entries; only compress them once
+  std::map<const void *, const StoredTile *> packedBlocks;
+
+  for (auto &entry : history->entries) {
+    for (StoredTile *stored : storedTiles(entry)) {
+      if (used <= history->budget) {
+        return;
+      }
+      if (!stored->tile.pixels || live.count(stored->tile.pixels.get())) {
+        continue;
+      }
+
+      const void *block = stored->tile.pixels.get();
+      auto found = packedBlocks.find(block);
+      if (found != packedBlocks.end() && !found->second->packed.empty()) {
+        stored->packed = found->second->packed;
+      } else {
+        int size;
+        unsigned char *packed = stbi_zlib_compress(
+            stored->tile.pixels->data(), stored->tile.pixels->size(), &size,
+            stbi_write_png_compression_level);
+        stored->packed.assign(packed, packed + size);
+        STBIW_FREE(packed);
+        packedBlocks[block] = stored;
+      }
+
+      used += stored->packed.size();
+      if (stored->tile.pixels.use_count() == 1) {
+        used -= stored->tile.pixels->size();
+      }
+      stored->tile.pixels.reset();
+    }
+  }
+
+  for (auto &entry : history->entries) {
+    for (StoredTile *stored : storedTiles(entry)) {
+      if (used <= history->budget) {
+        return;
+      }
+      if (stored->packed.empty()) {
+        continue;
+      }
+
+      size_t size = stored->packed.size();
+      if (!spillTile(history, stored)) {
+        return;
+      }
+      used -= size;
+    }
+  }
+}
+
+// Record everything that changed since the cursor. A new entry drops the
+// entries that could have been redone.
+void commitHistory(History *history, std::vector<Layer> &layers) {
   for (auto &layer : layers) {
-    Layer newLayer;
-    newLayer.height = layer.height;
-    newLayer.width = layer.width;
-    newLayer.enabled = layer.enabled;
+    compactLayerTiles(&layer);
+  }
 
-    bool ret = copyTexture(&(layer.layerData), &(newLayer.layerData),
-                           newLayer.width, newLayer.height);
-    IM_ASSERT(ret);
+  HistoryEntry entry = diffLayers(history->committed, layers);
+  if (!historyEntryEmpty(entry)) {
+    history->entries.resize(history->cursor);
+    history->entries.push_back(std::move(entry));
+    history->cursor = history->entries.size();
+  }
+  history->committed = snapshotLayers(layers);
+  trimHistory(history);
+}
+
+// Throw away edits made since the cursor. Tiles are swapped back, not copied.
+void revertToCursor(History *history, std::vector<Layer> &layers) {
+  applyHistoryEntry(history, layers, diffLayers(history->committed, layers),
+                    true);
+}
 
-    copiedLayers.push_back(newLayer);
+void undoHistory(History *history, std::vector<Layer> &layers) {
+  revertToCursor(history, layers);
+
+  if (history->cursor > 0) {
+    history->cursor--;
+    applyHistoryEntry(history, layers, history->entries[history->cursor],
+                      true);
   }
+  history->committed = snapshotLayers(layers);
+}
+
+void redoHistory(History *history, std::vector<Layer> &layers) {
+  revertToCursor(history, layers);
+
+  if (history->cursor < history->entries.size()) {
+    applyHistoryEntry(history, layers, history->entries[history->cursor],
+                      false);
+    history->cursor++;
+  }
+  history->committed = snapshotLayers(layers);
+}
+
+void clearHistory(History *history, const std::vector<Layer> &layers) {
+  history->entries.clear();
+  history->cursor = 0;
+  history->committed = snapshotLayers(layers);
+  closeHistorySpill(history);
+}
 
-  return copiedLayers;
+void showHistoryUsage(History *history) {
+  ImGui::Text("History: %.1f MB in memory, %.1f MB on disk",
+              historyMemoryUse(history) / (1024.0 * 1024.0),
+              history->spillEnd / (1024.0 * 1024.0));
 }
 
 bool showLayerInfo(std::vector<Layer> &layers, int window_width,
@@ -1270,7 +3412,10 @@ void showBrushSettingsPopup(ProgramState *state) {
     ImGui::Begin("Brush Settings", &(state->brushSettingsOpen));
 
     ImGui::DragInt("Brush Radius", &(state->brushState.radius), 1.0f, 1, 100);
+    ImGui::SliderFloat("Brush Hardness", &(state->brushState.hardness), 0.0f,
+                       1.0f);
     ImGui::ColorEdit4("Brush Color/Transparency", state->brushState.RGBA);
+    ImGui::Checkbox("Eraser", &(state->brushState.erase));
 
     if (ImGui::Button("OK")) {
       state->brushSettingsOpen = false;
@@ -1296,7 +3441,7 @@ void showWarningPopup(ProgramState *state) {
   }
 }
 
-void showLayerResizePopup(ProgramState *state, Layer *topActiveLayer) {
+bool showLayerResizePopup(ProgramState *state, Layer *topActiveLayer) {
 
   bool return_value = false;
 
@@ -1312,19 +3457,47 @@ void showLayerResizePopup(ProgramState *state, Layer *topActiveLayer) {
     if (ImGui::Button("OK")) {
       state->resizeLayerDialogOpen = false;
 
-      GLuint resizedTexture;
+      Layer resizedLayer;
 
-      generateUniformTexture(
-          &resizedTexture, state->layerResizeState.targetWidth,
+      generateUniformLayer(
+          &resizedLayer, state->layerResizeState.targetWidth,
           state->layerResizeState.targetHeight, 255, 255, 255, 255);
-      copyTextureToRegion(&(topActiveLayer->layerData), &resizedTexture,
-                          topActiveLayer->width, topActiveLayer->height,
-                          state->layerResizeState.targetWidth,
-                          state->layerResizeState.targetHeight, 0, 0, true);
+      copyLayerToRegion(*topActiveLayer, &resizedLayer, 0, 0, true);
+
+      releaseLayerTexture(topActiveLayer);
+      topActiveLayer->tiles.swap(resizedLayer.tiles);
+      topActiveLayer->width = resizedLayer.width;
+      topActiveLayer->height = resizedLayer.height;
+      topActiveLayer->tilesX = resizedLayer.tilesX;
+      topActiveLayer->tilesY = resizedLayer.tilesY;
+      return_value = true;
+    }
+
+    ImGui::End();
+  }
+
+  return return_value;
+}
+
+void showHistorySettingsPopup(ProgramState *state, History *history) {
+
+  if (state->historySettingsOpen) {
+    ImGui::SetNextWindowFocus();
+    ImGui::Begin("History Settings", &(state->historySettingsOpen));
+
+    ImGui::DragInt("Memory Budget (MB)", &(state->historyBudgetMB), 1.0f, 16,
+                   16384);
+    showHistoryUsage(history);
+
+    if (ImGui::Button("OK")) {
+      state->historySettingsOpen = false;
+
+      history->budget = (size_t)state->historyBudgetMB * 1024 * 1024;
+      trimHistory(history);
 
-      topActiveLayer->layerData = resizedTexture;
-      topActiveLayer->width = state->layerResizeState.targetWidth;
-      topActiveLayer->height = state->layerResizeState.targetHeight;
+      json settings = load_settings();
+      settings["history_budget_mb"] = state->historyBudgetMB;
+      save_settings(settings);
     }
 
     ImGui::End();
@@ -1339,9 +3512,17 @@ void showGenerationSettingsPopup(ProgramState *state) {
     ImGui::SetNextWindowFocus();
     ImGui::Begin("Generation Settings", &(state->generationSettingsOpen));
 
-    // ImGui::DragInt("Height", &(state->generationState.height), 1.0f, 1,
-    // 1024); ImGui::DragInt("Width", &(state->generationState.width), 1.0f, 1,
-    // 1024);
+    // The model samples in 64 pixel blocks; typed sizes are snapped once
+    // editing ends
+    GenerationState &generation = state->generationState;
+    ImGui::DragInt("Width", &generation.width, 64.0f, 64, 2048);
+    if (ImGui::IsItemDeactivatedAfterEdit()) {
+      generation.width = snapGenerationSize(generation.width);
+    }
+    ImGui::DragInt("Height", &generation.height, 64.0f, 64, 2048);
+    if (ImGui::IsItemDeactivatedAfterEdit()) {
+      generation.height = snapGenerationSize(generation.height);
+    }
 
     std::string path = state->tempEnvironmentState.stable_diffusion_path;
 
@@ -1354,12 +3535,17 @@ void showGenerationSettingsPopup(ProgramState *state) {
 
     state->tempEnvironmentState.stable_diffusion_path = std::string(text);
 
+    ImGui::Checkbox("Inpaint with stable-diffusion-webui",
+                    &(state->tempEnvironmentState.inpaint_with_webui));
+
     if (ImGui::Button("OK")) {
       state->generationSettingsOpen = false;
 
       json settings = load_settings();
       settings["stable_diffusion_path_set"] = true;
       settings["stable_diffusion_path"] = std::string(text);
+      settings["inpaint_with_webui"] =
+          state->tempEnvironmentState.inpaint_with_webui;
       save_settings(settings);
     }
 
@@ -1367,8 +3553,8 @@ void showGenerationSettingsPopup(ProgramState *state) {
   }
 }
 
-bool ShowGenerateTextInputPopup(ProgramState *state, GLuint *texture_id,
-                                int *width, int *height, bool *open) {
+bool ShowGenerateTextInputPopup(ProgramState *state, Layer *target,
+                                bool *open) {
 
   bool return_value = false;
 
@@ -1380,6 +3566,7 @@ bool ShowGenerateTextInputPopup(ProgramState *state, GLuint *texture_id,
 
     static char text[128] = "";
     ImGui::InputText("Input", text, IM_ARRAYSIZE(text));
+    ImGui::SliderInt("Images", &(state->generationState.batchCount), 1, 8);
 
     if (ImGui::Button("OK")) {
       *open = false;
@@ -1387,18 +3574,25 @@ bool ShowGenerateTextInputPopup(ProgramState *state, GLuint *texture_id,
 
       json settings = load_settings();
       if (settings["stable_diffusion_path_set"]) {
-        GenerateTexture(state, texture_id, prompt, state->generationState.width,
-                        state->generationState.height,
-                        settings["stable_diffusion_path"]);
-        *width = state->generationState.width;
-        *height = state->generationState.height;
+        SDParams params;
+        params.model_path = settings["stable_diffusion_path"];
+        params.prompt = prompt;
+        params.sample_steps = 20;
+        params.seed = std::rand();
+        params.batch_count = state->generationState.batchCount;
+
+        return_value = startGeneration(
+            &generationJob, params, state->generationState.width,
+            state->generationState.height, target->id);
+        if (!return_value) {
+          state->warningDialogOpen = true;
+          state->warningMessage = "A generation is already running.";
+        }
       } else {
         state->warningDialogOpen = true;
         state->warningMessage =
             "Please Specify a model path. Generate -> Generation Settings.";
       }
-
-      return_value = true;
     }
 
     ImGui::End();
@@ -1438,6 +3632,268 @@ bool checkContiguousSelection(std::vector<Layer> &layers) {
   return true && activeCount >= 2;
 }
 
+// Compositing runs on premultiplied RGBA8 in fixed point. Every path rounds
+// the same way, so the SIMD kernels match compositeRowScalar bit for bit.
+
+// Composite count straight-alpha src pixels over a premultiplied dst row.
+void compositeRowScalar(unsigned char *dst, const unsigned char *src,
+                        int count) {
+  for (int i = 0; i < count; i++, src += 4, dst += 4) {
+    unsigned a = src[3];
+    unsigned inv = 255 - a;
+    dst[0] = div255(src[0] * a) + div255(dst[0] * inv);
+    dst[1] = div255(src[1] * a) + div255(dst[1] * inv);
+    dst[2] = div255(src[2] * a) + div255(dst[2] * inv);
+    dst[3] = a + div255(dst[3] * inv);
+  }
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+// Two pixels widened to 16 bits per channel. The alpha lanes of the source
+// are scaled by 255, which div255 maps back to alpha itself.
+inline __m128i overPixelsSSE2(__m128i s, __m128i d) {
+  const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+  __m128i scale = _mm_or_si128(_mm_andnot_si128(alphaLanes, a),
+                               _mm_and_si128(alphaLanes, _mm_set1_epi16(255)));
+  __m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), a);
+  return _mm_add_epi16(div255Epu16(_mm_mullo_epi16(s, scale)),
+                       div255Epu16(_mm_mullo_epi16(d, inv)));
+}
+
+void compositeRowSSE2(unsigned char *dst, const unsigned char *src,
+                      int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alphaBytes = _mm_set1_epi32(0xFF000000);
+
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    __m128i alpha = _mm_and_si128(s, alphaBytes);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xFFFF) {
+      continue;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaBytes)) == 0xFFFF) {
+      _mm_storeu_si128((__m128i *)(dst + i * 4), s);
+      continue;
+    }
+
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 4));
+    __m128i lo = overPixelsSSE2(_mm_unpacklo_epi8(s, zero),
+                                _mm_unpacklo_epi8(d, zero));
+    __m128i hi = overPixelsSSE2(_mm_unpackhi_epi8(s, zero),
+                                _mm_unpackhi_epi8(d, zero));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_packus_epi16(lo, hi));
+  }
+
+  compositeRowScalar(dst + i * 4, src + i * 4, count - i);
+}
+#endif
+
+#ifdef SLOP_X86_DISPATCH
+SLOP_TARGET("avx2") inline __m256i div255Epu16(__m256i x) {
+  x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+SLOP_TARGET("avx2") inline __m256i overPixelsAVX2(__m256i s, __m256i d) {
+  const __m256i alphaLanes = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0,
+                                              0, 0, -1, 0, 0, 0);
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+  __m256i scale =
+      _mm256_or_si256(_mm256_andnot_si256(alphaLanes, a),
+                      _mm256_and_si256(alphaLanes, _mm256_set1_epi16(255)));
+  __m256i inv = _mm256_sub_epi16(_mm256_set1_epi16(255), a);
+  return _mm256_add_epi16(div255Epu16(_mm256_mullo_epi16(s, scale)),
+                          div255Epu16(_mm256_mullo_epi16(d, inv)));
+}
+
+// Unpacking and packing both work within 128-bit lanes, so the pixels come
+// back out in the order they went in.
+SLOP_TARGET("avx2")
+void compositeRowAVX2(unsigned char *dst, const unsigned char *src,
+                      int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alphaBytes = _mm256_set1_epi32(0xFF000000);
+
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    __m256i alpha = _mm256_and_si256(s, alphaBytes);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, zero)) == -1) {
+      continue;
+    }
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alphaBytes)) == -1) {
+      _mm256_storeu_si256((__m256i *)(dst + i * 4), s);
+      continue;
+    }
+
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i * 4));
+    __m256i lo = overPixelsAVX2(_mm256_unpacklo_epi8(s, zero),
+                                _mm256_unpacklo_epi8(d, zero));
+    __m256i hi = overPixelsAVX2(_mm256_unpackhi_epi8(s, zero),
+                                _mm256_unpackhi_epi8(d, zero));
+    _mm256_storeu_si256((__m256i *)(dst + i * 4),
+                        _mm256_packus_epi16(lo, hi));
+  }
+
+  compositeRowSSE2(dst + i * 4, src + i * 4, count - i);
+}
+#endif
+
+void compositeRow(unsigned char *dst, const unsigned char *src, int count) {
+#ifdef SLOP_X86_DISPATCH
+  if (cpuFeatures.avx2) {
+    compositeRowAVX2(dst, src, count);
+    return;
+  }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  compositeRowSSE2(dst, src, count);
+#else
+  compositeRowScalar(dst, src, count);
+#endif
+}
+
+// 16.16 reciprocals of each alpha value, scaled by 255.
+struct AlphaReciprocals {
+  unsigned value[256];
+
+  AlphaReciprocals() {
+    value[0] = 0;
+    for (int a = 1; a < 256; a++) {
+      value[a] = (255u * 65536 + a / 2) / a;
+    }
+  }
+};
+
+// Convert a premultiplied row back to straight alpha in place.
+void unpremultiplyRow(unsigned char *pixels, int count) {
+  // Flatten calls this from several workers at once; a function-local
+  // static is initialised exactly once even then
+  static const AlphaReciprocals reciprocals;
+  const unsigned *reciprocal = reciprocals.value;
+
+  for (int i = 0; i < count; i++, pixels += 4) {
+    unsigned a = pixels[3];
+    if (a == 0 || a == 255) {
+      continue;
+    }
+    for (int c = 0; c < 3; c++) {
+      pixels[c] = min(255u, (pixels[c] * reciprocal[a] + 32768) >> 16);
+    }
+  }
+}
+
+// Composite rows [rowBegin, rowEnd) of a tile, tileWidth pixels wide, over
+// dst, which points at row rowBegin and whose rows are dstStride bytes apart.
+// uniformRow is TILE_SIZE pixels of scratch space.
+void compositeTile(const Tile &tile, int tileWidth, int rowBegin, int rowEnd,
+                   unsigned char *dst, int dstStride,
+                   unsigned char *uniformRow) {
+  if (tile.coverage == TileCoverage::Transparent) {
+    return;
+  }
+
+  // Uniform tiles composite the same row over and over
+  const unsigned char *src = uniformRow;
+  int srcStride = 0;
+  if (tile.pixels) {
+    src = tile.pixels->data() + rowBegin * TILE_SIZE * 4;
+    srcStride = TILE_SIZE * 4;
+  } else {
+    for (int x = 0; x < tileWidth; ++x) {
+      std::memcpy(uniformRow + x * 4, tile.color, 4);
+    }
+  }
+
+  // Opaque pixels are the same premultiplied, and replace what is under them
+  bool opaque = tile.coverage == TileCoverage::Opaque;
+  for (int y = rowBegin; y < rowEnd; ++y) {
+    if (opaque) {
+      std::memcpy(dst, src, tileWidth * 4);
+    } else {
+      compositeRow(dst, src, tileWidth);
+    }
+    dst += dstStride;
+    src += srcStride;
+  }
+}
+
+bool layerCoversTile(const Layer &layer, int tx, int ty) {
+  return layer.enabled && tx < layer.tilesX && ty < layer.tilesY;
+}
+
+// Whether the layer hides everything under it in tile (tx, ty) of a
+// canvasWidth x canvasHeight image.
+bool layerOccludesTile(const Layer &layer, int tx, int ty, int canvasWidth,
+                       int canvasHeight) {
+  if (!layerCoversTile(layer, tx, ty) ||
+      layer.tiles[ty * layer.tilesX + tx].coverage != TileCoverage::Opaque) {
+    return false;
+  }
+
+  // The layer may end inside the tile while the canvas goes on
+  int x = tx * TILE_SIZE;
+  int y = ty * TILE_SIZE;
+  return min(TILE_SIZE, layer.width - x) == min(TILE_SIZE, canvasWidth - x) &&
+         min(TILE_SIZE, layer.height - y) == min(TILE_SIZE, canvasHeight - y);
+}
+
+// The bottom of the visible part of layers [first, last) in tile (tx, ty):
+// the topmost layer that hides everything under it, or first.
+int firstVisibleLayer(const std::vector<Layer> &layers, int first, int last,
+                      int tx, int ty, int canvasWidth, int canvasHeight) {
+  for (int i = last - 1; i > first; i--) {
+    if (layerOccludesTile(layers[i], tx, ty, canvasWidth, canvasHeight)) {
+      return i;
+    }
+  }
+  return first;
+}
+
+// Bands smaller than this aren't worth a thread.
+const int COMPOSITE_MIN_BAND_ROWS = 64;
+
+// Composite rows [y1, y2) of every enabled layer, bottom to top, into the
+// output image and convert them to straight alpha. Layers hidden under an
+// opaque tile are skipped.
+void compositeBand(const std::vector<Layer> &layers, unsigned char *output,
+                   int outputWidth, int outputHeight, int y1, int y2) {
+  // Initialize to transparent black
+  std::memset(output + y1 * outputWidth * 4, 0, (y2 - y1) * outputWidth * 4);
+
+  std::vector<unsigned char> uniformRow(TILE_SIZE * 4);
+
+  for (int ty = y1 / TILE_SIZE; ty <= (y2 - 1) / TILE_SIZE; ++ty) {
+    int rowBegin = max(y1, ty * TILE_SIZE);
+    int rowEnd = min(y2, (ty + 1) * TILE_SIZE);
+
+    for (int tx = 0; tx * TILE_SIZE < outputWidth; ++tx) {
+      int first = firstVisibleLayer(layers, 0, layers.size(), tx, ty,
+                                    outputWidth, outputHeight);
+
+      for (int i = first; i < layers.size(); ++i) {
+        const Layer &layer = layers[i];
+        int layerRowEnd = min(rowEnd, layer.height);
+        if (!layerCoversTile(layer, tx, ty) || rowBegin >= layerRowEnd) {
+          continue;
+        }
+
+        compositeTile(layer.tiles[ty * layer.tilesX + tx],
+                      min(TILE_SIZE, layer.width - tx * TILE_SIZE),
+                      rowBegin - ty * TILE_SIZE, layerRowEnd - ty * TILE_SIZE,
+                      output + (rowBegin * outputWidth + tx * TILE_SIZE) * 4,
+                      outputWidth * 4, uniformRow.data());
+      }
+    }
+  }
+
+  for (int y = y1; y < y2; ++y) {
+    unpremultiplyRow(output + y * outputWidth * 4, outputWidth);
+  }
+}
+
 struct FlattenedLayerData getFlattenedLayerData(std::vector<Layer> &layers) {
   if (layers.empty()) {
     FlattenedLayerData empty;
@@ -1466,91 +3922,314 @@ struct FlattenedLayerData getFlattenedLayerData(std::vector<Layer> &layers) {
     return empty;
   }
 
-  // Allocate buffer for the flattened output
+  // Allocate buffer for the flattened output; the bands clear their rows
   unsigned char *output = new unsigned char[maxWidth * maxHeight * 4]; // RGBA
-  std::memset(output, 0,
-              maxWidth * maxHeight * 4); // Initialize to transparent black
 
-  // Function to read pixels from an OpenGL texture
-  auto readTexturePixels = [](GLuint textureID, int width, int height,
-                              unsigned char *buffer) {
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, buffer);
-  };
+  // Composite in row bands, one per core; each band is independent
+  int threadCount = max(1, min((int)std::thread::hardware_concurrency(),
+                               maxHeight / COMPOSITE_MIN_BAND_ROWS));
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threadCount; ++i) {
+    workers.emplace_back(compositeBand, std::cref(layers), output, maxWidth,
+                         maxHeight, maxHeight * i / threadCount,
+                         maxHeight * (i + 1) / threadCount);
+  }
+  compositeBand(layers, output, maxWidth, maxHeight, 0,
+                maxHeight / threadCount);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  struct FlattenedLayerData data;
+
+  data.width = maxWidth;
+  data.height = maxHeight;
+  data.data = output;
+
+  return data;
+}
+
+// The enabled layers flattened into a single texture for display. Only the
+// tiles that changed since the last update are composited and uploaded.
+//
+// Per viewport tile, the layers under the active layer are kept
+// pre-composited, so redrawing a tile while painting is below + active
+// however many layers there are. The block is only rebuilt when one of its
+// own layers changes. The active layer is the topmost enabled one, which is
+// the layer painting goes to, so every layer over it is hidden and nothing
+// above it needs caching.
+struct Viewport {
+  TextureHandle texture;
+  int width = 0;
+  int height = 0;
+  // Id, visibility and size of every layer as of the last update; any
+  // difference means the whole image has to be rebuilt.
+  std::vector<int> signature;
+
+  // Layer the below blocks are split at.
+  int activeId = 0;
+  int tilesX = 0;
+  int tilesY = 0;
+  std::vector<bool> cached;
+  // Premultiplied TILE_SIZE x TILE_SIZE blocks; empty where no enabled layer
+  // covers the tile.
+  std::vector<std::vector<unsigned char>> below;
+};
+
+std::vector<int> viewportSignature(const std::vector<Layer> &layers) {
+  std::vector<int> signature;
+  for (const auto &layer : layers) {
+    signature.push_back(layer.id);
+    signature.push_back(layer.enabled);
+    signature.push_back(layer.width);
+    signature.push_back(layer.height);
+  }
+  return signature;
+}
+
+// Composite the enabled layers in [first, last) of one viewport tile into a
+// premultiplied block, leaving it empty if none of them cover the tile.
+void compositeLayerRange(const Viewport &viewport,
+                         const std::vector<Layer> &layers, int first, int last,
+                         int tx, int ty, std::vector<unsigned char> *block,
+                         unsigned char *uniformRow) {
+  std::vector<unsigned char>().swap(*block);
+  first = firstVisibleLayer(layers, first, last, tx, ty, viewport.width,
+                            viewport.height);
+  for (int i = first; i < last; i++) {
+    const Layer &layer = layers[i];
+    if (!layerCoversTile(layer, tx, ty)) {
+      continue;
+    }
+    if (block->empty()) {
+      block->assign(TILE_SIZE * TILE_SIZE * 4, 0);
+    }
+    compositeTile(layer.tiles[ty * layer.tilesX + tx],
+                  min(TILE_SIZE, layer.width - tx * TILE_SIZE), 0,
+                  min(TILE_SIZE, layer.height - ty * TILE_SIZE),
+                  block->data(), TILE_SIZE * 4, uniformRow);
+  }
+}
+
+// The below block of viewport tile (tx, ty) is missing, or one of the layers
+// under the active layer has changed there.
+bool viewportTileStale(const Viewport &viewport,
+                       const std::vector<Layer> &layers, int active, int tx,
+                       int ty) {
+  if (!viewport.cached[ty * viewport.tilesX + tx]) {
+    return true;
+  }
+  for (int i = 0; i < active; i++) {
+    if (layerCoversTile(layers[i], tx, ty) &&
+        layers[i].tiles[ty * layers[i].tilesX + tx].dirty) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Produce the straight-alpha pixels of viewport tile (tx, ty) in a
+// TILE_SIZE x TILE_SIZE block, refreshing its below block first if it is
+// stale.
+void composeViewportTile(Viewport *viewport, const std::vector<Layer> &layers,
+                         int active, int tx, int ty, unsigned char *pixels,
+                         unsigned char *uniformRow) {
+  int index = ty * viewport->tilesX + tx;
+
+  if (viewportTileStale(*viewport, layers, active, tx, ty)) {
+    compositeLayerRange(*viewport, layers, 0, active, tx, ty,
+                        &viewport->below[index], uniformRow);
+    viewport->cached[index] = true;
+  }
+
+  // Where the active layer is opaque it overwrites whatever is under it
+  const Layer &layer = layers[active];
+  const std::vector<unsigned char> &below = viewport->below[index];
+  if (!layerOccludesTile(layer, tx, ty, viewport->width, viewport->height)) {
+    if (below.empty()) {
+      std::memset(pixels, 0, TILE_SIZE * TILE_SIZE * 4);
+    } else {
+      std::memcpy(pixels, below.data(), below.size());
+    }
+  }
+
+  if (layerCoversTile(layer, tx, ty)) {
+    compositeTile(layer.tiles[ty * layer.tilesX + tx],
+                  min(TILE_SIZE, layer.width - tx * TILE_SIZE), 0,
+                  min(TILE_SIZE, layer.height - ty * TILE_SIZE), pixels,
+                  TILE_SIZE * 4, uniformRow);
+  }
+
+  unpremultiplyRow(pixels, TILE_SIZE * TILE_SIZE);
+}
 
-  // Blend layer data into the output buffer
+// Bring the viewport texture up to date with the layers. When resize is
+// false and the image size changed, nothing is done; the texture handed to
+// ImGui this frame must stay alive until it is drawn.
+void updateViewport(Viewport *viewport, std::vector<Layer> &layers,
+                    bool resize) {
+  int width = 0;
+  int height = 0;
   for (const auto &layer : layers) {
     if (layer.enabled) {
-      unsigned char *layerData =
-          new unsigned char[layer.width * layer.height * 4];
+      width = max(width, layer.width);
+      height = max(height, layer.height);
+    }
+  }
+
+  bool rebuild = viewport->texture.id == 0;
+  if (width != viewport->width || height != viewport->height) {
+    if (!resize) {
+      return;
+    }
+    releaseTexture(&viewport->texture);
+    viewport->width = width;
+    viewport->height = height;
+    rebuild = true;
+  }
+  if (width == 0 || height == 0) {
+    return;
+  }
 
-      readTexturePixels(layer.layerData, layer.width, layer.height, layerData);
+  std::vector<int> signature = viewportSignature(layers);
+  if (signature != viewport->signature) {
+    viewport->signature.swap(signature);
+    rebuild = true;
+  }
 
-      for (int y = 0; y < layer.height; ++y) {
-        for (int x = 0; x < layer.width; ++x) {
-          int layerIndex = (y * layer.width + x) * 4;
-          int outputIndex = (y * maxWidth + x) * 4;
+  int active = getTopActiveLayerIndex(layers);
+  if (layers[active].id != viewport->activeId) {
+    viewport->activeId = layers[active].id;
+    rebuild = true;
+  }
 
-          unsigned char r = layerData[layerIndex];
-          unsigned char g = layerData[layerIndex + 1];
-          unsigned char b = layerData[layerIndex + 2];
-          unsigned char a = layerData[layerIndex + 3];
+  if (rebuild) {
+    viewport->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    viewport->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int tileCount = viewport->tilesX * viewport->tilesY;
+    viewport->cached.assign(tileCount, false);
+    viewport->below.assign(tileCount, std::vector<unsigned char>());
+  }
 
-          float newAlpha = a / 255.0f;
-          float oldAlpha = output[outputIndex + 3] / 255.0f;
+  if (viewport->texture.id == 0) {
+    acquireTexture(&viewport->texture, width, height);
+  }
 
-          float blendedAlpha = newAlpha + oldAlpha * (1 - newAlpha);
+  std::vector<unsigned char> pixels(TILE_SIZE * TILE_SIZE * 4);
+  std::vector<unsigned char> uniformRow(TILE_SIZE * 4);
 
-          float alpha_out = oldAlpha + (newAlpha * (1 - oldAlpha));
-          output[outputIndex + 3] = static_cast<unsigned char>(alpha_out * 255);
-
-          output[outputIndex] = static_cast<unsigned char>(
-              (((output[outputIndex] * (oldAlpha) * (1 - newAlpha)) +
-                layerData[layerIndex] * newAlpha) /
-               blendedAlpha));
-          output[outputIndex + 1] = static_cast<unsigned char>(
-              (((output[outputIndex + 1] * (oldAlpha) * (1 - newAlpha)) +
-                layerData[layerIndex + 1] * newAlpha) /
-               blendedAlpha));
-          output[outputIndex + 2] = static_cast<unsigned char>(
-              (((output[outputIndex + 2] * (oldAlpha) * (1 - newAlpha)) +
-                layerData[layerIndex + 2] * newAlpha) /
-               blendedAlpha));
-        }
+  for (int ty = 0; ty < viewport->tilesY; ty++) {
+    for (int tx = 0; tx < viewport->tilesX; tx++) {
+      bool dirty = rebuild;
+      for (int i = 0; i < layers.size() && !dirty; i++) {
+        dirty = layerCoversTile(layers[i], tx, ty) &&
+                layers[i].tiles[ty * layers[i].tilesX + tx].dirty;
+      }
+      if (!dirty) {
+        continue;
+      }
+
+      composeViewportTile(viewport, layers, active, tx, ty, pixels.data(),
+                          uniformRow.data());
+
+      int x = tx * TILE_SIZE;
+      int y = ty * TILE_SIZE;
+      uploadTextureRect(&uploadRing, viewport->texture.id, x, y,
+                        min(TILE_SIZE, width - x), min(TILE_SIZE, height - y),
+                        pixels.data(), TILE_SIZE);
+    }
+  }
+  flushUploads(&uploadRing);
+
+  for (auto &layer : layers) {
+    for (auto &tile : layer.tiles) {
+      tile.dirty = false;
+    }
+  }
+}
+
+// The image the viewport shows, as straight alpha. The cached below blocks
+// are reused, so only the active layer is composited again. When the
+// viewport is out of step with the layer stack or any block is stale, the
+// band-parallel full flatten is used instead.
+struct FlattenedLayerData flattenViewport(Viewport *viewport,
+                                          std::vector<Layer> &layers) {
+  int active = getTopActiveLayerIndex(layers);
+  if (active == -1 || viewport->signature != viewportSignature(layers) ||
+      layers[active].id != viewport->activeId) {
+    return getFlattenedLayerData(layers);
+  }
+  for (int ty = 0; ty < viewport->tilesY; ty++) {
+    for (int tx = 0; tx < viewport->tilesX; tx++) {
+      if (viewportTileStale(*viewport, layers, active, tx, ty)) {
+        return getFlattenedLayerData(layers);
+      }
+    }
+  }
+
+  int width = viewport->width;
+  int height = viewport->height;
+  unsigned char *output = new unsigned char[width * height * 4]; // RGBA
+
+  std::vector<unsigned char> pixels(TILE_SIZE * TILE_SIZE * 4);
+  std::vector<unsigned char> uniformRow(TILE_SIZE * 4);
+
+  for (int ty = 0; ty < viewport->tilesY; ty++) {
+    for (int tx = 0; tx < viewport->tilesX; tx++) {
+      composeViewportTile(viewport, layers, active, tx, ty, pixels.data(),
+                          uniformRow.data());
+
+      int x = tx * TILE_SIZE;
+      int tileWidth = min(TILE_SIZE, width - x);
+      for (int y = ty * TILE_SIZE; y < min(height, (ty + 1) * TILE_SIZE);
+           y++) {
+        std::memcpy(output + (y * width + x) * 4,
+                    pixels.data() + (y - ty * TILE_SIZE) * TILE_SIZE * 4,
+                    tileWidth * 4);
       }
-      delete[] layerData;
     }
   }
 
   struct FlattenedLayerData data;
 
-  data.width = maxWidth;
-  data.height = maxHeight;
+  data.width = width;
+  data.height = height;
   data.data = output;
 
   return data;
 }
 
-void getInpaintResult(Layer &layer, std::string prompt) {
-
-  std::vector<Layer> layers = {layer};
-
-  const unsigned char *result = getFlattenedLayerData(layers).data;
-
-  save_png("to_inpaint.png", result, layer.width, layer.height);
+// The mask as webui expects it: opaque white where the mask is at least
+// half on, black elsewhere. webui applies its own mask blur.
+std::vector<unsigned char> webuiMaskImage(
+    const std::vector<unsigned char> &mask) {
+  std::vector<unsigned char> imageData(mask.size() * 4); // RGBA format
+  for (int i = 0; i < mask.size(); ++i) {
+    unsigned char value = mask[i] >= 128 ? 255 : 0;
+    imageData[i * 4] = value;     // Red
+    imageData[i * 4 + 1] = value; // Green
+    imageData[i * 4 + 2] = value; // Blue
+    imageData[i * 4 + 3] = 255;   // Alpha (fully opaque)
+  }
+  return imageData;
+}
 
-  // Define the URL
-  std::string url = "http://127.0.0.1:7860/sdapi/v1/img2img";
+// Sends the region of the layer and its part of the mask to the webui
+// img2img API and blends the result back in by the mask. Images travel as
+// base64 PNGs encoded and decoded in memory, so nothing is written to disk.
+// Returns true if the result was pasted.
+bool getInpaintResult(Layer &layer, const std::vector<unsigned char> &mask,
+                      const InpaintRegion &region, std::string prompt) {
+  std::vector<unsigned char> regionMask = cropMask(mask, layer.width, region);
 
   // Encode images to base64
-  std::string init_image_base64;
-  std::string mask_base64;
-  try {
-    init_image_base64 = encode_file_to_base64("to_inpaint.png");
-    mask_base64 = encode_file_to_base64("mask.png");
-  } catch (const std::runtime_error &e) {
-    std::cerr << "Error: " << e.what() << std::endl;
-    return;
+  std::string init_image_base64 = encode_png_to_base64(
+      cropLayer(layer, region).data(), region.width, region.height);
+  std::string mask_base64 = encode_png_to_base64(
+      webuiMaskImage(regionMask).data(), region.width, region.height);
+  if (init_image_base64.empty() || mask_base64.empty()) {
+    std::cerr << "Error: Could not encode inpaint images" << std::endl;
+    return false;
   }
 
   /**/
@@ -1565,9 +4244,9 @@ void getInpaintResult(Layer &layer, std::string prompt) {
         "inpainting_mask_invert": 0,
         "mask_blur": 4,
         "include_init_images": true,
-        "width": )" + std::to_string(layer.width) +
+        "width": )" + std::to_string(region.width) +
                         R"(,
-        "height":)" + std::to_string(layer.height) +
+        "height":)" + std::to_string(region.height) +
                         R"(,
         "denoising_strength": 0.75,
         "cfg_scale": 7,
@@ -1594,56 +4273,35 @@ void getInpaintResult(Layer &layer, std::string prompt) {
 
     std::string imageData = base64::from_base64(imageString);
 
-    // Write the decoded image to a file
-    std::ofstream out_file("output.png", std::ios::binary);
-    out_file.write(imageData.c_str(), imageData.size());
-    out_file.close();
+    int image_width = 0;
+    int image_height = 0;
+    unsigned char *image =
+        stbi_load_from_memory((const unsigned char *)imageData.data(),
+                              (int)imageData.size(), &image_width,
+                              &image_height, NULL, 3);
+    if (image == NULL) {
+      std::cerr << "Error: Could not decode inpaint result" << std::endl;
+      return false;
+    }
+    std::vector<unsigned char> rgb(region.width * region.height * 3);
+    stbir_resize_uint8(image, image_width, image_height, 0, rgb.data(),
+                       region.width, region.height, 0, 3);
+    stbi_image_free(image);
 
-    LoadTextureFromFile("output.png", &(layer.layerData), &layer.width,
-                        &layer.height);
+    if (!pasteInpaintResult(&layer, rgb.data(), regionMask.data(), region)) {
+      std::cerr << "Error: Inpaint result doesn't fit the layer" << std::endl;
+      return false;
+    }
+    return true;
 
   } catch (const std::exception &e) {
     std::cerr << "Request failed, error: " << e.what() << '\n';
   }
+  return false;
 }
 
-void saveMaskPng(GLuint maskTexture, int width, int height) {
-  // Step 1: Read the texture data from the GPU
-  std::vector<unsigned char> pixels(width * height * 4); // RGBA format
-
-  glBindTexture(GL_TEXTURE_2D, maskTexture);
-  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
-  glBindTexture(GL_TEXTURE_2D, 0);
-
-  // Step 2: Process the texture data
-  std::vector<unsigned char> imageData(width * height * 4); // RGBA format
-
-  for (int i = 0; i < width * height; ++i) {
-    unsigned char r = pixels[i * 4];
-    unsigned char g = pixels[i * 4 + 1];
-    unsigned char b = pixels[i * 4 + 2];
-
-    // If any color component is non-zero, we set the pixel to white; otherwise,
-    // black
-    if (r > 0 || g > 0 || b > 0) {
-      imageData[i * 4] = 255;     // Red
-      imageData[i * 4 + 1] = 255; // Green
-      imageData[i * 4 + 2] = 255; // Blue
-    } else {
-      imageData[i * 4] = 0;     // Red
-      imageData[i * 4 + 1] = 0; // Green
-      imageData[i * 4 + 2] = 0; // Blue
-    }
-
-    imageData[i * 4 + 3] = 255; // Alpha (fully opaque)
-  }
-
-  // Step 3: Write the processed image data to a PNG file
-  stbi_write_png("mask.png", width, height, 4, imageData.data(), width * 4);
-}
-
-bool ShowInpaintTextInputPopup(Layer &layer, GLuint inpaintOverlay,
-                               bool *open) {
+bool ShowInpaintTextInputPopup(ProgramState *state, Layer &layer,
+                               const Layer &inpaintOverlay, bool *open) {
 
   bool return_value = false;
 
@@ -1659,9 +4317,47 @@ bool ShowInpaintTextInputPopup(Layer &layer, GLuint inpaintOverlay,
     if (ImGui::Button("OK")) {
       *open = false;
       std::string prompt = std::string(text);
-      saveMaskPng(inpaintOverlay, layer.width, layer.height);
-      getInpaintResult(layer, prompt);
-      return_value = true;
+
+      // Only the region around the mask is sent. Inpainting runs locally
+      // unless the webui API is preferred; a local result lands in the
+      // layer later through finishGeneration
+      std::vector<unsigned char> mask =
+          inpaintMask(inpaintOverlay, INPAINT_MASK_BLUR);
+      InpaintRegion region;
+      json settings = load_settings();
+      if (layer.width != inpaintOverlay.width ||
+          layer.height != inpaintOverlay.height) {
+        state->warningDialogOpen = true;
+        state->warningMessage = "The layer was resized; start over.";
+      } else if (!findInpaintRegion(mask, inpaintOverlay.width,
+                                    inpaintOverlay.height, &region)) {
+        state->warningDialogOpen = true;
+        state->warningMessage = "Paint over the area to inpaint first.";
+      } else if (settings.value("inpaint_with_webui", false)) {
+        return_value = getInpaintResult(layer, mask, region, prompt);
+        if (!return_value) {
+          state->warningDialogOpen = true;
+          state->warningMessage = "Inpainting with stable-diffusion-webui "
+                                  "failed.";
+        }
+      } else if (settings["stable_diffusion_path_set"]) {
+        SDParams params;
+        params.model_path = settings["stable_diffusion_path"];
+        params.prompt = prompt;
+        params.sample_steps = 20;
+        params.seed = std::rand();
+
+        return_value =
+            startInpaint(&generationJob, params, layer, mask, region);
+        if (!return_value) {
+          state->warningDialogOpen = true;
+          state->warningMessage = "A generation is already running.";
+        }
+      } else {
+        state->warningDialogOpen = true;
+        state->warningMessage =
+            "Please Specify a model path. Generate -> Generation Settings.";
+      }
     }
 
     ImGui::End();
@@ -1716,6 +4412,7 @@ int main(int, char **) {
   if (window == nullptr)
     return 1;
   glfwMakeContextCurrent(window);
+  initUploadRing(&uploadRing);
   // glfwSwapInterval(1); // Enable vsync
 
   // Setup Dear ImGui context
@@ -1733,6 +4430,10 @@ int main(int, char **) {
 
   ImGui::StyleColorsDark();
 
+  // Installed first so the ImGui backend chains to them
+  glfwSetCursorPosCallback(window, canvasCursorPosCallback);
+  glfwSetMouseButtonCallback(window, canvasMouseButtonCallback);
+
   // Setup Platform/Renderer backends
   ImGui_ImplGlfw_InitForOpenGL(window, true);
 #ifdef __EMSCRIPTEN__
@@ -1740,25 +4441,22 @@ int main(int, char **) {
 #endif
   ImGui_ImplOpenGL3_Init(glsl_version);
 
-  std::stack<std::vector<Layer>> history;
-
   std::vector<Layer> initialLayers;
 
   Layer initialLayer;
-  initialLayer.width = 512;
-  initialLayer.height = 512;
-  initialLayer.layerData = 0;
   initialLayer.enabled = true;
-  bool ret =
-      generateUniformTexture(&(initialLayer.layerData), initialLayer.width,
-                             initialLayer.height, 255, 255, 255, 255);
+  initialLayer.id = newLayerId();
+  bool ret = generateUniformLayer(&initialLayer, 512, 512, 255, 255, 255, 255);
   IM_ASSERT(ret);
   initialLayers.push_back(initialLayer);
 
-  history.push(deepCopyLayers(initialLayers));
-
   std::vector<Layer> layers = initialLayers;
 
+  History history;
+  clearHistory(&history, layers);
+  history.budget =
+      (size_t)load_settings().value("history_budget_mb", 256) * 1024 * 1024;
+
   bool show_demo_window = true;
   bool show_another_window = false;
   ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
@@ -1772,6 +4470,7 @@ int main(int, char **) {
 
   bool inpaintPromptMode = false;
   bool inpaintDrawMode = false;
+  Stroke inpaintStroke;
 
   int scale_factor = 100;
 
@@ -1784,14 +4483,21 @@ int main(int, char **) {
                         // &my_image_width, &my_image_height);
   IM_ASSERT(ret);
 
-  GLuint inpaintOverlay = 0;
-  GLuint selectionOverlay = 0;
+  Layer inpaintOverlay;
+  Layer selectionOverlay;
 
   int prev_x_offset = -1;
   int prev_y_offset = -1;
 
   ImGui::FileBrowser filePicker;
 
+  Viewport viewport;
+
+  std::mutex canvasMutex;
+  StrokeRasterizer rasterizer;
+  canvasInput.queue = &rasterizer.queue;
+  startStrokeRasterizer(&rasterizer, &layers, &canvasMutex);
+
   // Main loop
 #ifdef __EMSCRIPTEN__
   // For an Emscripten build we are disabling file-system access, so let's not
@@ -1805,6 +4511,7 @@ int main(int, char **) {
   {
 
     glfwPollEvents();
+    std::unique_lock<std::mutex> canvasLock(canvasMutex);
     io.ConfigWindowsMoveFromTitleBarOnly = true;
     // Start the Dear ImGui frame
     ImGui_ImplOpenGL3_NewFrame();
@@ -1819,39 +4526,37 @@ int main(int, char **) {
 
     ActionType currentAction = ActionType::None;
 
+    // canvasMutex stays held from here until the history is committed, so
+    // the entry holds exactly the strokes finished by now
+    int finishedStrokes = rasterizer.finishedStrokes;
+    if (finishedStrokes != rasterizer.committedStrokes) {
+      historyNode = true;
+    }
+
     int x_offset;
     int y_offset;
 
     int i = 0;
 
-    // for (Layer layer : layers)
-    for (int i = 0; i < layers.size(); i++) {
-
-      Layer layer = layers[i];
-
-      if (!(layer.enabled)) {
-        continue;
-      }
-
+    // All enabled layers are shown flattened in one window
+    updateViewport(&viewport, layers, true);
+    canvasInput.hovered = false;
+    if (viewport.texture.id != 0) {
       ImGui::SetNextWindowPos(ImVec2(0 + viewOffsetX, viewOffsetY));
       ImGui::SetNextWindowSize(
-          ImVec2((scale_factor / 100.0) * layer.width + 40,
-                 (scale_factor / 100.0) * layer.height + 40));
+          ImVec2((scale_factor / 100.0) * viewport.width + 40,
+                 (scale_factor / 100.0) * viewport.height + 40));
 
       ImGuiWindowFlags flags =
           ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoBringToFrontOnFocus |
           ImGuiWindowFlags_NoScrollbar | ImGuiWindowFlags_NoMove |
           ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse |
           ImGuiWindowFlags_NoBackground;
-      ;
-
-      ImGui::Begin((std::string("Image Window") + std::to_string(i)).c_str(),
-                   &show_another_window, flags);
-      // i+=1; // Pass a pointer to our bool variable (the window will have a
-      // closing button that will clear the bool when clicked)
-      ImGui::Image((void *)(intptr_t)layer.layerData,
-                   ImVec2((scale_factor / 100.0) * layer.width,
-                          (scale_factor / 100.0) * layer.height));
+
+      ImGui::Begin("Image Window", &show_another_window, flags);
+      ImGui::Image((void *)(intptr_t)viewport.texture.id,
+                   ImVec2((scale_factor / 100.0) * viewport.width,
+                          (scale_factor / 100.0) * viewport.height));
       ImGui::BringWindowToDisplayFront(ImGui::GetCurrentWindow());
 
       x_offset = (ImGui::GetMousePos().x - ImGui::GetItemRectMin().x) /
@@ -1859,39 +4564,18 @@ int main(int, char **) {
       y_offset = (ImGui::GetMousePos().y - ImGui::GetItemRectMin().y) /
                  (scale_factor / 100.0);
 
-      if (i == topActiveIndex) {
-        if (!ImGui::GetIO().KeyCtrl &&
-            ImGui::IsMouseDown(ImGuiMouseButton_Left) &&
-            ImGui::IsWindowFocused() && x_offset < layer.width &&
-            x_offset >= 0 && y_offset < layer.height && y_offset >= 0) {
-          if (state.drawMode) {
-
-            if (prev_x_offset != -1 && prev_y_offset != -1) {
-
-              drawLine(layer.layerData, prev_x_offset, prev_y_offset, x_offset,
-                       y_offset, layer.width, layer.height,
-                       state.brushState.radius, state.brushState.RGBA[0] * 255,
-                       state.brushState.RGBA[1] * 255,
-                       state.brushState.RGBA[2] * 255,
-                       state.brushState.RGBA[3] * 255);
-            }
-
-            drawCircle(
-                layer.layerData, x_offset, y_offset, layer.width, layer.height,
-                state.brushState.radius, state.brushState.RGBA[0] * 255,
-                state.brushState.RGBA[1] * 255, state.brushState.RGBA[2] * 255,
-                state.brushState.RGBA[3] * 255);
-
-          } else {
-            state.drawMode = true;
-          }
-          prev_x_offset = x_offset;
-          prev_y_offset = y_offset;
+      if (topActiveIndex != -1) {
+        Layer &layer = layers[topActiveIndex];
 
-        } else if (state.drawMode) {
-          state.drawMode = false;
-          historyNode = true;
-        }
+        // Strokes are painted by the raster thread from the input callbacks
+        canvasInput.hovered = ImGui::IsItemHovered();
+        canvasInput.originX = ImGui::GetItemRectMin().x;
+        canvasInput.originY = ImGui::GetItemRectMin().y;
+        canvasInput.scale = scale_factor / 100.0f;
+        canvasInput.layerId = layer.id;
+        canvasInput.width = layer.width;
+        canvasInput.height = layer.height;
+        canvasInput.brush = state.brushState;
 
         if (ImGui::GetIO().KeyCtrl) {
 
@@ -1949,9 +4633,16 @@ int main(int, char **) {
       if (ImGui::BeginMenu("Edit")) {
         ImGui::BringWindowToDisplayFront(ImGui::GetCurrentWindow());
 
-        if (ImGui::MenuItem("Undo")) {
+        if (ImGui::MenuItem("Undo", "Ctrl+Z")) {
           currentAction = ActionType::Undo;
         }
+        if (ImGui::MenuItem("Redo", "Ctrl+Shift+Z")) {
+          currentAction = ActionType::Redo;
+        }
+        if (ImGui::MenuItem("History Settings")) {
+          currentAction = ActionType::HistorySettings;
+        }
+        showHistoryUsage(&history);
 
         ImGui::EndMenu();
       }
@@ -1994,6 +4685,13 @@ int main(int, char **) {
         if (ImGui::MenuItem("Generation Settings")) {
           currentAction = ActionType::GenerationSettings;
         }
+        // The worker owns the model cache while a job runs, so the context
+        // is only looked at once it has been joined
+        if (ImGui::MenuItem("Unload Model", NULL, false,
+                            !generationJob.running &&
+                                modelCache.ctx != nullptr)) {
+          currentAction = ActionType::UnloadModel;
+        }
         ImGui::EndMenu();
       }
 
@@ -2052,22 +4750,31 @@ int main(int, char **) {
       prompt_popup_open = true;
     } else if (currentAction == ActionType::Inpaint) {
       state.inpaintMode = true;
-      ret = GenerateEmptyTexture(&inpaintOverlay, layers[topActiveIndex].width,
-                                 layers[topActiveIndex].height);
+      ret = generateUniformLayer(&inpaintOverlay, layers[topActiveIndex].width,
+                                 layers[topActiveIndex].height, 0, 0, 0, 0);
       IM_ASSERT(ret);
     } else if (currentAction == ActionType::BrushSettings) {
       state.brushSettingsOpen = true;
+    } else if (currentAction == ActionType::HistorySettings) {
+      state.historyBudgetMB = history.budget / (1024 * 1024);
+      state.historySettingsOpen = true;
+    } else if (currentAction == ActionType::UnloadModel) {
+      if (!generationJob.running) {
+        unloadModel(&modelCache);
+      }
     } else if (currentAction == ActionType::GenerationSettings) {
       json tempEnvironmentJson = load_settings();
       state.tempEnvironmentState.stable_diffusion_path_set =
           tempEnvironmentJson["stable_diffusion_path_set"];
       state.tempEnvironmentState.stable_diffusion_path =
           tempEnvironmentJson["stable_diffusion_path"];
+      state.tempEnvironmentState.inpaint_with_webui =
+          tempEnvironmentJson.value("inpaint_with_webui", false);
       state.generationSettingsOpen = true;
     } else if (currentAction == ActionType::BoxSelect) {
-      ret =
-          GenerateEmptyTexture(&selectionOverlay, layers[topActiveIndex].width,
-                               layers[topActiveIndex].height);
+      ret = generateUniformLayer(&selectionOverlay,
+                                 layers[topActiveIndex].width,
+                                 layers[topActiveIndex].height, 0, 0, 0, 0);
       IM_ASSERT(ret);
       state.selectionMode = true;
     } else if (currentAction == ActionType::ResizeLayer) {
@@ -2080,7 +4787,7 @@ int main(int, char **) {
         state.warningMessage = "Active Layers must be contiguous; there must "
                                "be 2 or more selected layers.";
       } else {
-        FlattenedLayerData result = getFlattenedLayerData(layers);
+        FlattenedLayerData result = flattenViewport(&viewport, layers);
         unsigned char *data = result.data;
         std::vector<int> toRemove;
 
@@ -2093,36 +4800,34 @@ int main(int, char **) {
 
         removeLayers(layers, toRemove);
 
-        GLuint flat_texture_id;
-        glGenTextures(1, &flat_texture_id);
-        glBindTexture(GL_TEXTURE_2D, flat_texture_id);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, result.width, result.height, 0,
-                     GL_RGBA, GL_UNSIGNED_BYTE, data);
+        layerFromBuffer(&layers[toRemove[0]], data, result.width,
+                        result.height);
         delete[] data;
 
-        layers[toRemove[0]].layerData = flat_texture_id;
-        layers[toRemove[0]].width = result.width;
-        layers[toRemove[0]].height = result.height;
-
         topActiveIndex = getTopActiveLayerIndex(layers);
 
         historyNode = true;
       }
     }
 
-    if (ShowGenerateTextInputPopup(&state, &(layers[topActiveIndex].layerData),
-                                   &(layers[topActiveIndex].width),
-                                   &(layers[topActiveIndex].height),
-                                   &prompt_popup_open)) {
+    ShowGenerateTextInputPopup(&state, &(layers[topActiveIndex]),
+                               &prompt_popup_open);
+    showGenerationProgress(&generationJob);
+    if (finishGeneration(&state, &generationJob, layers,
+                         &generationCandidates)) {
+      historyNode = true;
+    }
+    if (showGenerationCandidates(&generationCandidates, layers)) {
       historyNode = true;
     }
 
     showBrushSettingsPopup(&state);
     showGenerationSettingsPopup(&state);
-    showLayerResizePopup(&state, &(layers[topActiveIndex]));
+    if (showLayerResizePopup(&state, &(layers[topActiveIndex]))) {
+      historyNode = true;
+    }
     showWarningPopup(&state);
+    showHistorySettingsPopup(&state, &history);
 
     int window_width;
     int window_height;
@@ -2137,16 +4842,8 @@ int main(int, char **) {
     if (filePicker.HasSelected()) {
 
       if (currentFilePickerAction == FilePickerActionType::Import) {
-        GLuint load_target = 0;
-        int load_target_width = 0;
-        int load_target_height = 0;
-
-        LoadTextureFromFile(filePicker.GetSelected().string().c_str(),
-                            &(load_target), &load_target_width,
-                            &load_target_height);
-        layers[topActiveIndex].layerData = load_target;
-        layers[topActiveIndex].width = load_target_width;
-        layers[topActiveIndex].height = load_target_height;
+        LoadLayerFromFile(filePicker.GetSelected().string().c_str(),
+                          &(layers[topActiveIndex]));
 
         filePicker.ClearSelected();
         // history.push(layers);
@@ -2167,7 +4864,7 @@ int main(int, char **) {
       }
 
       if (currentFilePickerAction == FilePickerActionType::Export) {
-        unsigned char *result = getFlattenedLayerData(layers).data;
+        unsigned char *result = flattenViewport(&viewport, layers).data;
 
         int maxWidth = 0;
         int maxHeight = 0;
@@ -2186,12 +4883,9 @@ int main(int, char **) {
 
     if (currentAction == ActionType::AddLayer) {
       Layer newLayer;
-      newLayer.width = 512;
-      newLayer.height = 512;
-      newLayer.layerData = 0;
       newLayer.enabled = true;
-      bool ret = generateUniformTexture(&(newLayer.layerData), newLayer.width,
-                                        newLayer.height, 0, 0, 0, 0);
+      newLayer.id = newLayerId();
+      bool ret = generateUniformLayer(&newLayer, 512, 512, 0, 0, 0, 0);
       IM_ASSERT(ret);
       layers.push_back(newLayer);
       historyNode = true;
@@ -2199,6 +4893,7 @@ int main(int, char **) {
 
     if (currentAction == ActionType::RemoveLayer) {
       if (layers.size() > 1 && topActiveIndex != -1) {
+        releaseLayerTexture(&layers[topActiveIndex]);
         layers.erase(layers.begin() + topActiveIndex);
         historyNode = true;
       }
@@ -2218,8 +4913,9 @@ int main(int, char **) {
       ImGui::Begin("Inpaint Overlay", &(state.inpaintMode), flags);
       ImGui::BringWindowToDisplayFront(ImGui::GetCurrentWindow());
 
+      syncLayerTexture(&inpaintOverlay);
       ImGui::Image(
-          (void *)(intptr_t)inpaintOverlay,
+          (void *)(intptr_t)inpaintOverlay.layerData.id,
           ImVec2((scale_factor / 100) * layers[topActiveIndex].width,
                  (scale_factor / 100) * layers[topActiveIndex].height));
 
@@ -2236,31 +4932,32 @@ int main(int, char **) {
         if (inpaintDrawMode) {
           if (prev_x_offset != -1 && prev_y_offset != -1) {
 
-            drawLine(inpaintOverlay, prev_x_offset, prev_y_offset, x_offset,
-                     y_offset, layers[topActiveIndex].width,
-                     layers[topActiveIndex].height, 10, 100, 100, 0, 100);
+            drawLine(&inpaintOverlay, &inpaintStroke, prev_x_offset,
+                     prev_y_offset, x_offset, y_offset, 10, 1.0f, 100, 100, 0,
+                     100);
           }
 
-          drawCircle(inpaintOverlay, x_offset, y_offset,
-                     layers[topActiveIndex].width,
-                     layers[topActiveIndex].height, 10, 100, 100, 0, 100);
+          drawCircle(&inpaintOverlay, &inpaintStroke, x_offset, y_offset, 10,
+                     1.0f, 100, 100, 0, 100);
 
         } else {
           inpaintDrawMode = true;
+          beginStroke(&inpaintStroke);
         }
         prev_x_offset = x_offset;
         prev_y_offset = y_offset;
 
       } else if (inpaintDrawMode) {
         inpaintDrawMode = false;
+        endStroke(&inpaintStroke);
       }
       if (ImGui::Button("OK")) {
 
         inpaintPromptMode = true;
         historyNode = true;
       }
-      if (ShowInpaintTextInputPopup(layers[topActiveIndex], inpaintOverlay,
-                                    &inpaintPromptMode)) {
+      if (ShowInpaintTextInputPopup(&state, layers[topActiveIndex],
+                                    inpaintOverlay, &inpaintPromptMode)) {
         state.inpaintMode = false;
         historyNode = true;
       }
@@ -2302,8 +4999,9 @@ int main(int, char **) {
                      flags);
         ImGui::BringWindowToDisplayFront(ImGui::GetCurrentWindow());
 
+        syncLayerTexture(&state.selectionState.selection);
         ImGui::Image(
-            (void *)(intptr_t)state.selectionState.selection,
+            (void *)(intptr_t)state.selectionState.selection.layerData.id,
             ImVec2(ImVec2(
                 (scale_factor / 100.0) * (state.selectionState.corner2[0] -
                                           state.selectionState.corner1[0]),
@@ -2332,8 +5030,9 @@ int main(int, char **) {
       ImGui::Begin("Selection Overlay", &(state.selectionMode), flags);
       ImGui::BringWindowToDisplayFront(ImGui::GetCurrentWindow());
 
+      syncLayerTexture(&selectionOverlay);
       ImGui::Image(
-          (void *)(intptr_t)selectionOverlay,
+          (void *)(intptr_t)selectionOverlay.layerData.id,
           ImVec2((scale_factor / 100.0) * layers[topActiveIndex].width,
                  (scale_factor / 100.0) * layers[topActiveIndex].height));
 
@@ -2405,17 +5104,14 @@ int main(int, char **) {
         state.selectionState.corner2[1] = min(layers[topActiveIndex].height - 1,
                                               state.selectionState.corner2[1]);
 
-        copyTextureSubset(
-            &(layers[topActiveIndex].layerData),
-            &(state.selectionState.selection), layers[topActiveIndex].width,
-            layers[topActiveIndex].height, state.selectionState.corner1[0],
-            state.selectionState.corner1[1], state.selectionState.corner2[0],
-            state.selectionState.corner2[1]);
-        drawBox(
-            layers[topActiveIndex].layerData, state.selectionState.corner1[0],
-            state.selectionState.corner1[1], state.selectionState.corner2[0],
-            state.selectionState.corner2[1], layers[topActiveIndex].width,
-            layers[topActiveIndex].height, 1, 0, 0, 0, 0, true);
+        copyLayerSubset(
+            layers[topActiveIndex], &(state.selectionState.selection),
+            state.selectionState.corner1[0], state.selectionState.corner1[1],
+            state.selectionState.corner2[0], state.selectionState.corner2[1]);
+        drawBox(&(layers[topActiveIndex]), state.selectionState.corner1[0],
+                state.selectionState.corner1[1],
+                state.selectionState.corner2[0],
+                state.selectionState.corner2[1], 1, 0, 0, 0, 0, true);
 
         state.selectionState.dragging = false;
       } else if (ImGui::IsMouseDown(ImGuiMouseButton_Left) &&
@@ -2663,16 +5359,12 @@ int main(int, char **) {
                    y_offset >= state.selectionState.corner1[1] &&
                    y_offset <= state.selectionState.corner2[1])) {
 
-        resizeTexture(
+        resizeLayer(
             &state.selectionState.selection,
             state.selectionState.corner2[0] - state.selectionState.corner1[0],
             state.selectionState.corner2[1] - state.selectionState.corner1[1]);
-        copyTextureToRegion(
-            &(state.selectionState.selection),
-            &(layers[topActiveIndex].layerData),
-            state.selectionState.corner2[0] - state.selectionState.corner1[0],
-            state.selectionState.corner2[1] - state.selectionState.corner1[1],
-            layers[topActiveIndex].width, layers[topActiveIndex].height,
+        copyLayerToRegion(
+            state.selectionState.selection, &(layers[topActiveIndex]),
             state.selectionState.selectionXOffset / (scale_factor / 100.0) +
                 state.selectionState.corner1[0],
             state.selectionState.selectionYOffset / (scale_factor / 100.0) +
@@ -2689,10 +5381,9 @@ int main(int, char **) {
 
       if (state.selectionState.completeSelection) {
         drawSelectionBox(
-            selectionOverlay, state.selectionState.corner1[0],
+            &selectionOverlay, state.selectionState.corner1[0],
             state.selectionState.corner1[1], state.selectionState.corner2[0],
-            state.selectionState.corner2[1], layers[topActiveIndex].width,
-            layers[topActiveIndex].height, 1, 0, 0, 0, 255, false);
+            state.selectionState.corner2[1], 1, 0, 0, 0, 255, false);
       }
 
       ImGui::End();
@@ -2701,20 +5392,15 @@ int main(int, char **) {
     // Rendering
     ImGui::Render();
 
-    if (ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)) &&
-            ImGui::GetIO().KeyCtrl ||
-        currentAction == ActionType::Undo) {
-      if (history.size() > 1) {
-
-        for (int i = 0; i < history.top().size(); i++) {
-          freeLayer(&(history.top()[i]));
-        }
+    bool undoKey = ImGui::IsKeyPressed(ImGui::GetKeyIndex(ImGuiKey_Z)) &&
+                   ImGui::GetIO().KeyCtrl;
 
-        history.pop();
-        layers = deepCopyLayers(history.top());
-      } else if (history.size() == 1) {
-        layers = deepCopyLayers(history.top());
-      }
+    if ((undoKey && !ImGui::GetIO().KeyShift) ||
+        currentAction == ActionType::Undo) {
+      undoHistory(&history, layers);
+    } else if ((undoKey && ImGui::GetIO().KeyShift) ||
+               currentAction == ActionType::Redo) {
+      redoHistory(&history, layers);
     }
 
     if (!state.dragMode && ImGui::IsMouseDown(ImGuiMouseButton_Left) &&
@@ -2743,23 +5429,47 @@ int main(int, char **) {
     glClearColor(clear_color.x * clear_color.w, clear_color.y * clear_color.w,
                  clear_color.z * clear_color.w, clear_color.w);
     glClear(GL_COLOR_BUFFER_BIT);
-    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-    glfwSwapBuffers(window);
 
     if (historyNode) {
       if (resetHistory) {
-        while (!history.empty()) {
-          history.pop();
-        }
+        clearHistory(&history, layers);
+      } else {
+        commitHistory(&history, layers);
       }
-      history.push(deepCopyLayers(layers));
     }
+    commitStrokes(&rasterizer, finishedStrokes);
+
+    // Upload this frame's edits before the textures are drawn
+    updateViewport(&viewport, layers, false);
+    if (inpaintOverlay.layerData.id != 0) {
+      syncLayerTexture(&inpaintOverlay);
+    }
+    if (selectionOverlay.layerData.id != 0) {
+      syncLayerTexture(&selectionOverlay);
+    }
+
+    // The raster thread paints while the frame is drawn
+    canvasLock.unlock();
+    ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    glfwSwapBuffers(window);
+    canvasLock.lock();
+
+    recycleRetiredTextures();
   }
 #ifdef __EMSCRIPTEN__
   EMSCRIPTEN_MAINLOOP_END;
 #endif
 
   // Cleanup
+  stopStrokeRasterizer(&rasterizer);
+  cancelGeneration(&generationJob);
+  if (generationJob.thread.joinable()) {
+    generationJob.thread.join();
+  }
+  unloadModel(&modelCache);
+  closeHistorySpill(&history);
+  destroyUploadRing(&uploadRing);
+  clearTexturePool();
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();